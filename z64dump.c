@@ -2,24 +2,84 @@
  * author:		SoulofDeity (Bitskit)
  *************************************************************************/
 #include <malloc.h>
+#include <stdarg.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
 
 #ifdef _WIN32
 #include <direct.h>
+#include <windows.h>
+#include <psapi.h>
 #else
-#include <sys/types.h>
-#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#endif
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define HAVE_X86 1
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+#include <immintrin.h>
 #endif
 
+#include "z64dump.h"
+
 
 #ifdef _WIN32
 #define mkdir(dir) _mkdir(dir)
 #else
-#define mkdir(dir) mkdir(dir, 0777 & ~umask(0))
+#define mkdir(dir) mkdir(dir, 0777)
+#endif
+
+#ifdef _WIN32
+typedef HANDLE Thread;
+typedef CRITICAL_SECTION Mutex;
+typedef CONDITION_VARIABLE Cond;
+#define THREAD_FUNC(name)	DWORD WINAPI name(LPVOID arg)
+#define THREAD_LOCAL		__declspec(thread)
+#define ThreadCreate(t, f, a)	((*(t) = CreateThread(NULL, 0, f, a, 0, NULL)) != NULL)
+#define ThreadJoin(t)		(WaitForSingleObject(t, INFINITE), CloseHandle(t))
+#define MutexInit(m)		InitializeCriticalSection(m)
+#define MutexDestroy(m)		DeleteCriticalSection(m)
+#define MutexLock(m)		EnterCriticalSection(m)
+#define MutexUnlock(m)		LeaveCriticalSection(m)
+#define CondInit(c)		InitializeConditionVariable(c)
+#define CondDestroy(c)
+#define CondWait(c, m)		SleepConditionVariableCS(c, m, INFINITE)
+#define CondBroadcast(c)	WakeAllConditionVariable(c)
+#else
+typedef pthread_t Thread;
+typedef pthread_mutex_t Mutex;
+typedef pthread_cond_t Cond;
+#define THREAD_FUNC(name)	void *name(void *arg)
+#define THREAD_LOCAL		__thread
+#define ThreadCreate(t, f, a)	(!pthread_create(t, NULL, f, a))
+#define ThreadJoin(t)		pthread_join(t, NULL)
+#define MutexInit(m)		pthread_mutex_init(m, NULL)
+#define MutexDestroy(m)		pthread_mutex_destroy(m)
+#define MutexLock(m)		pthread_mutex_lock(m)
+#define MutexUnlock(m)		pthread_mutex_unlock(m)
+#define CondInit(c)		pthread_cond_init(c, NULL)
+#define CondDestroy(c)		pthread_cond_destroy(c)
+#define CondWait(c, m)		pthread_cond_wait(c, m)
+#define CondBroadcast(c)	pthread_cond_broadcast(c)
 #endif
 
 
@@ -29,860 +89,5771 @@
                                   (f)->physical.start = READ32((d) + 8); \
                                   (f)->physical.end = READ32((d) + 12); }
 
+#define MAX_NAME		Z64_MAX_NAME
+
+#define WRITE_QUEUE		256
+#define WRITE32(d, v)		{ (d)[0] = (v) >> 24; (d)[1] = (v) >> 16; (d)[2] = (v) >> 8; (d)[3] = (v); }
+#define WRITE16(d, v)		{ (d)[0] = (v) >> 8; (d)[1] = (v); }
+
+#define ARCHIVE_HEADER		32
+#define ARCHIVE_ENTRY		32
+#define ARCHIVE_SHARED		1	/* entry flag: payload belongs to an earlier entry */
+
+#define MANIFEST_FILE		"data/.manifest"
+#define MANIFEST_HEADER		"# z64dump manifest 1\n"
+#define INDEX_HEADER		"# z64dump index 1\n"
+
+#define SCENE_HEADER		0x100	/* bytes of a scene decoded to look for map lists */
+#define POOL_HEADER		16
+#define POOL_MIN_SHIFT		12
+#define POOL_CLASSES		13
+#define POOL_RETAIN		(32 << 20)
+
+#define BENCHMARK_GROWTH	4.0	/* most a stage's time per file may grow from 1x to 8x */
+#define BENCHMARK_MIN_MS	20.0	/* stages faster than this at 8x are too noisy to judge */
+
+#if defined(__GNUC__) || defined(__clang__)
+#define TARGET(isa)		__attribute__((target(isa)))
+#else
+#define TARGET(isa)
+#endif
+
+
+typedef Z64File FileTableEntry;
 
 typedef struct
   {
-    struct
-      {
-        uint32_t start, end;
-      } physical, virtual;
-    uint8_t *data;
+    uint32_t start, end, index;
+  } VromIndex;
+
+typedef struct PoolBuffer
+  {
+    struct PoolBuffer *next;
     uint32_t size;
-  } FileTableEntry;
+    uint8_t sizeClass;
+  } PoolBuffer;
+
+typedef struct
+  {
+    PoolBuffer *free[POOL_CLASSES];
+    uint64_t retained, requests, mallocs, reuses, releases, inUse, peak;
+    Mutex lock;
+  } BufferPool;
+
+typedef struct CacheEntry
+  {
+    uint8_t *data;
+    uint32_t size, refs, decoded, srcPos;
+    uint8_t state;
+    struct CacheEntry *prev, *next;
+  } CacheEntry;
+
+typedef struct
+  {
+    CacheEntry *entries, *lru, *mru;
+    uint64_t bytes, budget, hits, misses, peak;
+    Mutex lock;
+    Cond ready;
+  } FileCache;
+
+typedef struct
+  {
+    uint32_t offset, length;
+  } FileName;
+
+typedef struct
+  {
+    FileTableEntry *sample;
+    uint8_t *count;
+  } CodeTable;
+
+typedef struct
+  {
+    uint32_t files, maps;
+  } ExtractResult;
+
+typedef struct
+  {
+    uint32_t pending;
+  } TaskGroup;
+
+/* what Z64Rebuild() has for one file; raw is NULL for files it leaves alone */
+typedef struct
+  {
+    uint8_t *raw, *packed;
+    uint32_t rawSize, packedSize, start, end;	/* start and end are the new vrom range */
+    uint32_t path, paths;			/* range in Rebuild.paths */
+  } RebuildFile;
+
+typedef struct
+  {
+    char *path;
+    int32_t file;
+  } RebuildPath;
+
+typedef struct
+  {
+    FILE *out;
+    int format;
+    uint32_t rows;
+  } Catalog;
+
+typedef struct
+  {
+    double wall, cpu;
+  } StageClock;
+
+/* where a Yaz0 decode stopped, always on a group boundary */
+typedef struct
+  {
+    const uint8_t *src;
+    uint8_t *dst;
+    uint32_t srcSize, dstSize, srcPos, dstPos;
+  } Yaz0Stream;
+
+typedef struct
+  {
+    char path[512];
+    FileTableEntry file;
+    uint64_t source;
+    uint32_t *written;
+    uint16_t table, sub;
+    uint8_t type;
+  } WriteRequest;
+
+typedef struct
+  {
+    char *name;
+    int32_t file;
+    uint32_t vrom, offset, size;
+    uint32_t first;		/* index entry whose payload this is, see ArchiveFinish() */
+    uint16_t table, sub;
+    uint8_t type, flags;
+  } ArchiveEntry;
+
+typedef struct Directory
+  {
+    char *path;
+    int fd;
+    struct Directory *next;
+  } Directory;
+
+typedef struct Blob
+  {
+    uint64_t hash;
+    uint32_t size, offset;
+    int32_t file;
+    char *path;
+    struct Blob *next;
+  } Blob;
+
+typedef struct ManifestEntry
+  {
+    char *path;
+    uint64_t source;
+    int64_t mtime;
+    uint32_t vrom, size;
+    int32_t file;
+    uint16_t table, sub;
+    uint8_t type, state;
+    struct ManifestEntry *next;
+  } ManifestEntry;
+
+typedef struct
+  {
+    WriteRequest *requests;
+    uint32_t head, tail, busy;
+    int stop, running;
+    Directory *dirs[256];
+    char root[512];
+    int rootFd;
+    FILE *archive, *spool;
+    ArchiveEntry *entries;
+    uint32_t entryCount, entryCapacity, offset, nameSize;
+    Blob *blobs[1024];
+    uint64_t duplicates, saved;
+    ManifestEntry *manifest[1024], *records;
+    uint32_t unchanged, rewritten;
+    int dedup, incremental;
+    Thread thread;
+    Mutex lock;
+    Cond wake;
+  } Writer;
 
 typedef struct
   {
-    char *filename;
-    uint8_t isMM, steSize, oc, ac, sc, *data;
+    char *filename, root[512], archive[512], listJson[512], listCsv[512], statsFile[512];
+    char rebuild[512];
+    int status;
+  } BatchRom;
+
+typedef struct
+  {
+    BatchRom *roms;
+    uint32_t count, capacity;
+    uint64_t cacheSize;
+    Z64Options options;
+    int list, listText, stats, statsText, noIndex;
+    const char *listJson, *listCsv, *rebuild, *serve, *statsFile;
+    Mutex lock;
+  } Batch;
+
+/* what --make-rom and --benchmark-roms generate; order 0 = z64, 1 = n64, 2 = v64 */
+typedef struct
+  {
+    int mm, order;
+    uint32_t scenes, maps, actors, objects, misc, size, code, seed;
+  } SyntheticSpec;
+
+/* a rom --serve keeps open, with its tables resolved to file indices */
+typedef struct
+  {
+    Z64Rom *rom;
+    int32_t *entries[3];
+    uint32_t length[3];
+  } ServedRom;
+
+/* --serve requests and replies; see Serve() */
+enum
+  {
+    SERVE_INFO		= 0,
+    SERVE_LIST		= 1,
+    SERVE_TABLE		= 2,
+    SERVE_FILE		= 3,
+    SERVE_NAME		= 4
+  };
+
+enum
+  {
+    SERVE_OK		= 0,
+    SERVE_BAD_REQUEST	= 1,
+    SERVE_NOT_FOUND	= 2,
+    SERVE_FAILED	= 3
+  };
+
+#define SERVE_MAX_REQUEST	1024
+#define SERVE_MAX_CLIENTS	64
+
+/* everything known about one rom; Z64Rom in the library interface */
+typedef struct Z64Rom
+  {
+    char *filename, *indexFile;
+    uint8_t isMM, steSize, oc, ac, sc, mapped, located, *data, *fileTypes;
     uint32_t size, fileNameTable;
+    VromIndex *vromIndex;
+    FileName *fileNames;
     struct
       {
         uint32_t start, size;
       } fileTable, sceneTable, objectTable, actorTable;
+    FileTableEntry code, actor[3], object[3], scene[3];
+    FileCache cache;
+    Writer writer;
+    Z64Options options;
+    Z64Stats stats;
+    ExtractResult *results;
+    FILE *log;
   } Rom;
 
+typedef struct
+  {
+    Rom *rom;
+    RebuildFile *files;
+    RebuildPath *paths;
+    uint32_t pathCount, pathCapacity, replaced, moved;
+    int status;				/* Z64_OK or why the rebuild can't go on */
+    char root[512];
+    FILE *archive;
+    ArchiveEntry *entries;
+    uint32_t entryCount;
+    Mutex lock;
+  } Rebuild;
+
+typedef struct
+  {
+    void (*func)(void *arg, uint32_t index);
+    void *arg;
+    uint32_t index;
+    TaskGroup *group;
+  } Task;
+
+typedef struct
+  {
+    Mutex lock;
+    Task *tasks;
+    uint32_t head, tail, capacity;
+  } TaskQueue;
+
+typedef struct
+  {
+    Thread *threads;
+    TaskQueue *queues;
+    uint32_t workers, started, queued;
+    int stop;
+    Mutex lock;
+    Cond wake;
+  } ThreadPool;
+
+typedef struct
+  {
+    const char *name;
+    int (*supported)(void);
+    void (*swap16)(uint8_t *data, uint32_t size);
+    void (*swap32)(uint8_t *data, uint32_t size);
+  } ByteswapKernel;
+
+
+enum
+  {
+    YAZ0_OK		= 0,
+    YAZ0_TRUNCATED	= -1,
+    YAZ0_BAD_REFERENCE	= -2
+  };
+
+enum
+  {
+    MANIFEST_STALE	= 0,	/* not produced by this run, its file is removed */
+    MANIFEST_UNCHANGED	= 1,	/* skipped, carried over to the new manifest */
+    MANIFEST_REWRITTEN	= 2,	/* written again to the same path */
+    MANIFEST_REPLACED	= 3	/* written again to a different path */
+  };
+
+enum
+  {
+    SOURCE_NONE		= 0,	/* the entry doesn't point at anything */
+    SOURCE_PLAIN	= 1,	/* stored as is */
+    SOURCE_YAZ0		= 2	/* compressed */
+  };
+
+/* boot chips RomChecksum() knows; the 6101 sums like the 6102 */
+enum
+  {
+    CIC_6102		= 0,
+    CIC_6103		= 1,
+    CIC_6105		= 2,
+    CIC_6106		= 3
+  };
+
+enum
+  {
+    FILE_VIEW		= 0,	/* points into the rom */
+    FILE_CACHED		= 1,	/* holds a reference to a cache entry */
+    FILE_OWNED		= 2	/* private buffer from the buffer pool */
+  };
 
 enum
   {
-    ZDATA		= 0,
-    ZASM		= 1,
-    ZACTOR		= 2,
-    ZOBJ		= 4,
-    ZSCENE		= 5,
-    ZMAP		= 6,
-    ZTXT		= 7
+    CACHE_EMPTY		= 0,
+    CACHE_LOADING	= 1,
+    CACHE_READY		= 2,
+    CACHE_FAILED	= 3,
+    CACHE_PARTIAL	= 4	/* only the first decoded bytes are there */
   };
 
 
 
-static Rom rom = {0};
-static FileTableEntry code = {0}, actor[3], object[3], scene[3];
+static ThreadPool pool = {0};
+static BufferPool buffers = {0};
+static THREAD_LOCAL int workerId = -1;
+
 
+static void Log(Rom *rom, const char *format, ...);
+static double GetTime(void);
+static double GetCpuTime(void);
+static void StageStart(StageClock *clock);
+static void StageLap(Rom *rom, int stage, StageClock *clock);
+static int LoadRom(Rom *rom);
+static void UnloadRom(Rom *rom);
+static int Byteswap(Rom *rom);
+static const ByteswapKernel *GetByteswapKernel(void);
+#ifndef Z64DUMP_LIBRARY
+static void Benchmark(void);
+static int MakeRom(const char *filename, const char *text);
+static int BenchmarkRoms(const Z64Options *base, uint64_t cacheSize);
+static int Serve(Batch *batch, const char *path);
+static int AddRom(Batch *batch, const char *filename);
+static int ReadRomList(Batch *batch, const char *filename);
+static int ParseOnly(Z64Options *options, const char *list);
+static int ParseIds(Z64Options *options, const char *range);
+static int ParseCategories(Z64Options *options, const char *list);
+static int SetBatchOutput(Batch *batch);
+static int ListRom(Batch *batch, BatchRom *entry, Z64Rom *rom, FILE *log);
+static int ReportStats(Batch *batch, BatchRom *entry, Z64Rom *rom, FILE *log);
+static void ProcessRom(void *arg, uint32_t index);
+static void FreeBatch(Batch *batch);
+#endif
+static void CheckRomType(Rom *rom);
+static int LocateFileTable(Rom *rom);
+static int BuildVromIndex(Rom *rom);
+static void ScanRom(Rom *rom);
+static int LocateFileNameTable(Rom *rom);
+static int BuildFileNameIndex(Rom *rom);
+static int LocateCodeFile(Rom *rom);
+static void ClassifyFile(void *arg, uint32_t index);
+static void ScanCodeFile(Rom *rom);
+static int LocateSceneTable(Rom *rom);
+static int LocateObjectTable(Rom *rom);
+static int LocateActorTable(Rom *rom);
+static int LoadIndex(Rom *rom);
+static void SaveIndex(Rom *rom);
+static int ExtractScenesAndMaps(Rom *rom);
+static void ExtractScene(void *arg, uint32_t id);
+static int ExtractActors(Rom *rom);
+static void ExtractActor(void *arg, uint32_t id);
+static int ExtractObjects(Rom *rom);
+static void ExtractObject(void *arg, uint32_t id);
+static int NextMapList(Rom *rom, FileTableEntry *scene, uint32_t *offset, uint32_t *count,
+                       uint32_t *list);
+static void ScenePath(Rom *rom, char *path, uint32_t id, int32_t fileNum);
+static void MapPath(Rom *rom, char *path, uint32_t sceneId, int32_t fileNum);
+static void ActorPath(Rom *rom, char *filePath, uint32_t id, uint32_t group, uint32_t objectId,
+                      int32_t fileNum);
+static void ObjectPath(Rom *rom, char *filePath, uint32_t id, int32_t fileNum);
+static int RebuildPaths(Rebuild *rebuild);
+static int CompareRebuildPaths(const void *a, const void *b);
+static int RebuildArchive(Rebuild *rebuild, const char *filename);
+static void RebuildRead(void *arg, uint32_t index);
+static int RebuildPatch(Rebuild *rebuild);
+static void RebuildPack(void *arg, uint32_t index);
+static uint8_t *RebuildLayout(Rebuild *rebuild, uint32_t *romSize);
+static int RebuildChecksum(Rom *rom, uint8_t *out, uint32_t size);
+static void RebuildFree(Rebuild *rebuild);
+static void ListScenesAndMaps(Rom *rom, Catalog *catalog);
+static void ListActors(Rom *rom, Catalog *catalog);
+static void ListObjects(Rom *rom, Catalog *catalog);
+static void CatalogBegin(Rom *rom, Catalog *catalog);
+static void CatalogEnd(Rom *rom, Catalog *catalog);
+static void PrintJsonString(FILE *out, const char *s);
+static uint32_t GetTableLength(Rom *rom, uint32_t start, uint32_t stride);
+static int Extracts(Rom *rom, uint32_t what);
+static int IdSelected(Rom *rom, uint32_t id);
+static int NameSelected(Rom *rom, int32_t index);
+static int Filtered(const Z64Options *options);
+
+static int WriterStart(Rom *rom, const Z64Options *options);
+static void WriterStop(Rom *rom);
+static void WriterFlush(Rom *rom);
+static void WriteFile(Rom *rom, const char *path, int type, uint32_t table, uint32_t sub,
+                      FileTableEntry *fte, uint64_t source, uint32_t *written);
+static int Unchanged(Rom *rom, int type, uint32_t table, uint32_t sub, int32_t index,
+                     uint32_t extra, uint64_t *source);
+static int ManifestFinish(Rom *rom);
+static int ArchiveFinish(Rom *rom);
+static int MakeDirectories(const char *path);
+static uint64_t HashData(const uint8_t *data, uint32_t size);
 
-static void Byteswap(void);
-static void CheckRomType(void);
-static void LocateFileTable(void);
-static void LocateFileNameTable(void);
-static void LocateCodeFile(void);
-static void LocateSceneTable(void);
-static void LocateObjectTable(void);
-static void LocateActorTable(void);
-static void ExtractScenesAndMaps(void);
-static void ExtractActors(void);
-static void ExtractObjects(void);
+static int PoolStart(uint32_t jobs);
+static void PoolStop(void);
+static void ParallelFor(uint32_t count, void (*func)(void *arg, uint32_t index), void *arg);
 
-static void yaz0dec(uint8_t *src, uint8_t *dst, uint32_t size);
+static int yaz0dec(const uint8_t *src, uint32_t srcSize, uint8_t *dst, uint32_t dstSize);
+static int yaz0resume(Yaz0Stream *stream, uint32_t until);
+static uint32_t yaz0enc(const uint8_t *src, uint32_t size, uint8_t *dst);
 
-static int GetFile(FileTableEntry *fte, int32_t index);
-static int GetFileNumber(uint32_t start, uint32_t end);
-static void GetFileName(char *buffer, int32_t index);
-static int GetFileType(uint8_t *data, uint32_t size);
+static int FindFile(Rom *rom, FileTableEntry *fte, int32_t index, uint32_t *srcSize);
+static int GetFile(Rom *rom, FileTableEntry *fte, int32_t index);
+static int GetFilePrefix(Rom *rom, FileTableEntry *fte, int32_t index, uint32_t bytes);
+static int ExtendFile(Rom *rom, FileTableEntry *fte, uint32_t bytes);
+static void PutFile(Rom *rom, FileTableEntry *fte);
+static int CacheGet(Rom *rom, FileTableEntry *fte, const uint8_t *src, uint32_t srcSize,
+                    uint32_t want);
+static int CacheDecode(Rom *rom, CacheEntry *entry, FileTableEntry *fte, const uint8_t *src,
+                       uint32_t srcSize, uint32_t want);
+static void CacheUnlink(Rom *rom, CacheEntry *entry);
+static void CacheTrim(Rom *rom);
+static int CacheInit(Rom *rom);
+static uint8_t *BufferAlloc(uint32_t size);
+static void BufferFree(uint8_t *data);
+static void BufferPoolInit(void);
+static void BufferPoolFree(void);
+static void CacheFree(Rom *rom);
+static int GetFileNumber(Rom *rom, uint32_t start, uint32_t end);
+static uint32_t GetFileName(Rom *rom, char *buffer, int32_t index);
+static int GetFileType(const uint8_t *data, uint32_t size);
+static int GetHeaderType(const uint8_t *data, uint32_t size);
 
 
 
+#ifndef Z64DUMP_LIBRARY
 int main(int argc, char *argv[])
   {
     printf("z64dump4 by SoulofDeity\n---------------------------------------------\n");
-    int i;
+    int i, allocStats = 0, benchmarkRoms = 0;
+    uint32_t jobs = 1, failed = 0;
+    Batch batch = {0};
+    batch.cacheSize = 64 << 20;
     for (i = 1; i < argc; i++)
       {
         if (*argv[i] == '-')
           {
             if (!strcmp(argv[i], "--help"))
               {
-                printf("Usage:  z64dump4 [options] romfile\n"
+                printf("Usage:  z64dump4 [options] romfile [romfile...]\n"
                        "\n"
                        "Options Include:\n"
-                       "    --help  shows this message\n");
+                       "    --help       shows this message\n"
+                       "    --jobs N     extracts with N threads (0 = one per cpu)\n"
+                       "    --cache MB   keeps up to MB of decompressed files (default 64)\n"
+                       "    --output DIR writes data/ into DIR instead of the current directory\n"
+                       "    --batch FILE also extracts the roms listed in FILE, one per line\n"
+                       "    --archive FILE writes everything into one pack file\n"
+                       "    --dedup      stores identical files once (hardlinks in data/)\n"
+                       "    --incremental  only rewrites files that changed since the last\n"
+                       "                 run (tracked in data/.manifest, not with --archive)\n"
+                       "    --only LIST  extracts only scenes, maps, actors and/or objects\n"
+                       "                 (comma separated)\n"
+                       "    --ids A[-B]  extracts only table ids A to B\n"
+                       "    --category LIST  extracts only actors of these groups\n"
+                       "                 (comma separated numbers)\n"
+                       "    --name GLOB  extracts only files whose name matches GLOB\n"
+                       "    --list       prints the catalog of the rom instead of extracting\n"
+                       "    --list-json FILE  writes the catalog to FILE as json\n"
+                       "    --list-csv FILE   writes the catalog to FILE as csv (any of the\n"
+                       "                 three --list options can be combined)\n"
+                       "    --stats      prints the time spent in every stage and what was\n"
+                       "                 scanned, decompressed and written\n"
+                       "    --stats-json FILE writes the same numbers to FILE as json\n"
+                       "    --no-index   neither reads nor writes ROM.index, which remembers\n"
+                       "                 where the tables of ROM are for the next run\n"
+                       "    --alloc-stats  prints the decompression buffer counters\n"
+                       "    --benchmark  times the internal kernels and exits\n"
+                       "    --make-rom FILE SPEC  writes a synthetic rom and exits; SPEC is\n"
+                       "                 oot or mm, then any of scenes=N, maps=N (per scene),\n"
+                       "                 actors=N, objects=N, misc=N, size=BYTES, code=BYTES,\n"
+                       "                 seed=N, order=z64|n64|v64 (comma separated)\n"
+                       "    --rebuild FILE  writes a new rom to FILE with the files in data/\n"
+                       "                 under the output directory (or in --archive) put\n"
+                       "                 back into the rom, instead of extracting\n"
+                       "    --serve PATH keeps the roms open and answers requests for their\n"
+                       "                 tables and files on the unix socket PATH\n"
+                       "    --benchmark-roms  extracts synthetic roms of growing size into\n"
+                       "                 the output directory (default z64bench) and prints\n"
+                       "                 the time per stage and per file\n"
+                       "\n"
+                       "With more than one rom, each is extracted into a directory named after\n"
+                       "the rom inside the output directory, and --archive, --list-*, --rebuild\n"
+                       "and --stats-json files go there too.  The catalog honours the same filters\n"
+                       "as extraction.\n");
+                FreeBatch(&batch);
+                return 0;
+              }
+            else if (!strcmp(argv[i], "--jobs") && i + 1 < argc)
+              {
+                jobs = strtoul(argv[++i], NULL, 0);
+              }
+            else if (!strcmp(argv[i], "--cache") && i + 1 < argc)
+              {
+                batch.cacheSize = (uint64_t) strtoul(argv[++i], NULL, 0) << 20;
+              }
+            else if (!strcmp(argv[i], "--output") && i + 1 < argc)
+              {
+                batch.options.output = argv[++i];
+              }
+            else if (!strcmp(argv[i], "--batch") && i + 1 < argc)
+              {
+                if (!ReadRomList(&batch, argv[++i]))
+                  {
+                    printf("ERROR:  Failed to read '%s'\n", argv[i]);
+                    FreeBatch(&batch);
+                    return 0;
+                  }
+              }
+            else if (!strcmp(argv[i], "--archive") && i + 1 < argc)
+              {
+                batch.options.archive = argv[++i];
+              }
+            else if (!strcmp(argv[i], "--dedup"))
+              {
+                batch.options.dedup = 1;
+              }
+            else if (!strcmp(argv[i], "--incremental"))
+              {
+                batch.options.incremental = 1;
+              }
+            else if (!strcmp(argv[i], "--only") && i + 1 < argc)
+              {
+                if (!ParseOnly(&batch.options, argv[++i]))
+                  {
+                    printf("ERROR:  Invalid list '%s' for --only\n", argv[i]);
+                    FreeBatch(&batch);
+                    return 0;
+                  }
+              }
+            else if (!strcmp(argv[i], "--ids") && i + 1 < argc)
+              {
+                if (!ParseIds(&batch.options, argv[++i]))
+                  {
+                    printf("ERROR:  Invalid range '%s' for --ids\n", argv[i]);
+                    FreeBatch(&batch);
+                    return 0;
+                  }
+              }
+            else if (!strcmp(argv[i], "--category") && i + 1 < argc)
+              {
+                if (!ParseCategories(&batch.options, argv[++i]))
+                  {
+                    printf("ERROR:  Invalid list '%s' for --category\n", argv[i]);
+                    FreeBatch(&batch);
+                    return 0;
+                  }
+              }
+            else if (!strcmp(argv[i], "--name") && i + 1 < argc)
+              {
+                batch.options.name = argv[++i];
+              }
+            else if (!strcmp(argv[i], "--list"))
+              {
+                batch.list = batch.listText = 1;
+              }
+            else if (!strcmp(argv[i], "--list-json") && i + 1 < argc)
+              {
+                batch.list = 1;
+                batch.listJson = argv[++i];
+              }
+            else if (!strcmp(argv[i], "--list-csv") && i + 1 < argc)
+              {
+                batch.list = 1;
+                batch.listCsv = argv[++i];
+              }
+            else if (!strcmp(argv[i], "--stats"))
+              {
+                batch.stats = batch.statsText = 1;
+              }
+            else if (!strcmp(argv[i], "--stats-json") && i + 1 < argc)
+              {
+                batch.stats = 1;
+                batch.statsFile = argv[++i];
+              }
+            else if (!strcmp(argv[i], "--no-index"))
+              {
+                batch.noIndex = 1;
+              }
+            else if (!strcmp(argv[i], "--alloc-stats"))
+              {
+                allocStats = 1;
+              }
+            else if (!strcmp(argv[i], "--benchmark"))
+              {
+                Benchmark();
+                FreeBatch(&batch);
                 return 0;
               }
+            else if (!strcmp(argv[i], "--make-rom") && i + 2 < argc)
+              {
+                FreeBatch(&batch);
+                return !MakeRom(argv[i + 1], argv[i + 2]);
+              }
+            else if (!strcmp(argv[i], "--rebuild") && i + 1 < argc)
+              {
+                batch.rebuild = argv[++i];
+              }
+            else if (!strcmp(argv[i], "--serve") && i + 1 < argc)
+              {
+                batch.serve = argv[++i];
+              }
+            else if (!strcmp(argv[i], "--benchmark-roms"))
+              {
+                benchmarkRoms = 1;
+              }
             else
               {
                 printf("ERROR:  Invalid options '%s'\n", argv[i]);
+                FreeBatch(&batch);
                 return 0;
               }
           }
-        else if (!rom.filename)
+        else if (!AddRom(&batch, argv[i]))
           {
-            rom.filename = argv[i];
+            printf("ERROR:  Failed to allocate memory\n");
+            FreeBatch(&batch);
+            return 0;
           }
+      }
+    if (benchmarkRoms)
+      {
+        failed = 1;
+        if (!Z64Init(jobs))
+          printf("ERROR:  Failed to start %i threads\n", jobs);
         else
           {
-            printf("ERROR: Invalid argument '%s'\n", argv[i]);
-            return 0;
+            failed = !BenchmarkRoms(&batch.options, batch.cacheSize);
+            Z64Shutdown();
           }
+        FreeBatch(&batch);
+        return failed;
       }
-    if (!rom.filename)
+    if (!batch.count)
       {
         printf("ERROR: No rom file specified\n");
+        FreeBatch(&batch);
         return 0;
       }
-    FILE *fp = fopen(rom.filename, "rb");
-    if (!fp)
+    if (batch.serve)
       {
-        printf("ERROR: Failed to open '%s'\n", rom.filename);
+        if (!Z64Init(jobs))
+          printf("ERROR:  Failed to start %i threads\n", jobs);
+        else
+          {
+            Serve(&batch, batch.serve);
+            Z64Shutdown();
+          }
+        FreeBatch(&batch);
         return 0;
       }
-    fseek(fp, 0, SEEK_END);
-    rom.size = ftell(fp);
-    rom.data = (uint8_t *) malloc(rom.size);
-    if (!rom.data)
+    if (!SetBatchOutput(&batch))
       {
-        printf("ERROR:  Failed to allocate memory\n");
-        fclose(fp);
+        printf("ERROR:  Output path too long\n");
+        FreeBatch(&batch);
         return 0;
       }
-    rewind(fp);
-    fread(rom.data, 1, rom.size, fp);
-    fclose(fp);
-    Byteswap();
-    CheckRomType();
-    LocateFileTable();
-    LocateCodeFile();
-    LocateFileNameTable();
-    LocateSceneTable();
-    LocateObjectTable();
-    LocateActorTable();
-    ExtractScenesAndMaps();
-    ExtractActors();
-    ExtractObjects();
-    if (code.physical.end)
-      free(code.data);
-    free(rom.data);
+    if (!Z64Init(jobs))
+      {
+        printf("ERROR:  Failed to start %i threads\n", jobs);
+        FreeBatch(&batch);
+        return 0;
+      }
+    MutexInit(&batch.lock);
+    ParallelFor(batch.count, ProcessRom, &batch);
+    MutexDestroy(&batch.lock);
+    for (i = 0; i < batch.count; i++)
+      failed += batch.roms[i].status != Z64_OK;
+    if (batch.count > 1)
+      printf("batch: %i roms, %i %s, %i failed\n", batch.count, batch.count - failed,
+             batch.list ? "listed" : batch.rebuild ? "rebuilt" : "extracted", failed);
+    if (allocStats && (batch.count > 1 || !failed))
+      printf("buffers: %llu requests, %llu reused, %llu from malloc, %llu released, "
+             "peak %.1f MB in use\n", (unsigned long long) buffers.requests,
+             (unsigned long long) buffers.reuses, (unsigned long long) buffers.mallocs,
+             (unsigned long long) buffers.releases, buffers.peak / 1048576.0);
+    FreeBatch(&batch);
+    Z64Shutdown();
     return 0;
   }
 
 
-
-static void error()
+static int AddRom(Batch *batch, const char *filename)
   {
-    if (code.physical.end)
-      free(code.data);
-    free(rom.data);
-    exit(0);
+    BatchRom *roms;
+    uint32_t capacity;
+    if (batch->count == batch->capacity)
+      {
+        capacity = batch->capacity ? batch->capacity * 2 : 16;
+        if (!(roms = (BatchRom *) realloc(batch->roms, capacity * sizeof(BatchRom))))
+          return 0;
+        batch->roms = roms;
+        batch->capacity = capacity;
+      }
+    memset(&batch->roms[batch->count], 0, sizeof(BatchRom));
+    if (!(batch->roms[batch->count].filename = strdup(filename)))
+      return 0;
+    batch->count++;
+    return 1;
   }
 
 
-static void Byteswap(void)
+/* one rom per line; blank lines and lines starting with # are skipped */
+static int ReadRomList(Batch *batch, const char *filename)
   {
-    printf("byteswapping...              ");
-    switch (READ32(&rom.data[0]))
+    char line[1024];
+    uint32_t n;
+    FILE *fp = fopen(filename, "r");
+    if (!fp)
+      return 0;
+    while (fgets(line, sizeof(line), fp))
       {
-        case 0x80371240:
-          {
-            printf("ok\n");
-            return;
-          }
-        case 0x40123780:
-          {
-            printf("little endian");
-            uint32_t i, c;
-            for (i = 0; i < rom.size; i += 4)
-              {
-                c = rom.data[i];
-                rom.data[i] = rom.data[i + 3];
-                rom.data[i + 3] = c;
-                c = rom.data[i + 1];
-                rom.data[i + 1] = rom.data[i + 2];
-                rom.data[i + 2] = c;
-              }
-            break;
-          }
-        case 0x37804012:
-          {
-            printf("middle endian");
-            uint32_t i, c;
-            for (i = 0; i < rom.size; i += 4)
-              {
-                c = rom.data[i];
-                rom.data[i] = rom.data[i + 1];
-                rom.data[i + 1] = c;
-                c = rom.data[i + 2];
-                rom.data[i + 2] = rom.data[i + 3];
-                rom.data[i + 3] = c;
-              }
-            break;
-          }
-        default:
+        for (n = strlen(line); n && (line[n - 1] == '\n' || line[n - 1] == '\r'); line[--n] = 0);
+        if (n && *line != '#' && !AddRom(batch, line))
           {
-            printf("error: unknown endianness\n");
-            error();
+            fclose(fp);
+            return 0;
           }
       }
-    printf(" -> big endian\n");
+    fclose(fp);
+    return 1;
   }
 
 
-static void CheckRomType(void)
+/* --only scenes,maps,actors,objects */
+static int ParseOnly(Z64Options *options, const char *list)
   {
-    printf("checking rom type...         ");
-    rom.steSize = 0x14;
-    if (!memcmp(&rom.data[0x20], "ZELDA MAJORA'S MASK ", 20))
+    static const char *names[] = {"scenes", "maps", "actors", "objects"};
+    uint32_t i, length;
+    options->extract = 0;
+    for (; *list; list += length + (list[length] == ','))
       {
-        printf("Majora's Mask\n");
-        rom.isMM = 1;
-        rom.steSize -= 4;
+        length = strcspn(list, ",");
+        for (i = 0; i < 4 && (strlen(names[i]) != length || strncmp(list, names[i], length)); i++);
+        if (i == 4)
+          return 0;
+        options->extract |= 1 << i;
       }
-    else
-      printf("Ocarina of Time\n");
+    return options->extract != 0;
   }
 
 
-static void LocateFileTable(void)
+/* --ids 5 or --ids 0x10-0x1F, both ends included */
+static int ParseIds(Z64Options *options, const char *range)
   {
-    printf("locating file table...       ");
-    uint32_t i, found = 0;
-    FileTableEntry fte;
-    for (i = 0; i < rom.size; i += 16)
-      {
-        READFTE(&fte, &rom.data[i]);
-        if (!found && !fte.virtual.start && fte.virtual.end == 0x00001060 &&
-            !fte.physical.start && !fte.physical.end)
-          found++;
-        else if (found)
-          {
-            if (fte.virtual.start == 0x00001060 && fte.virtual.end &&
-                fte.physical.start == 0x00001060 && !fte.physical.end)
-              {
-                rom.fileTable.start = i - 16;
-                READFTE(&fte, &rom.data[i + 16]);
-                rom.fileTable.size = fte.virtual.end - fte.virtual.start;
-                break;
-              }
-            else
-              found = 0;
-          }
-      }
-    if (found)
-      printf("found [%08X, %i files]\n", rom.fileTable.start, rom.fileTable.size / 16);
-    else
+    char *end;
+    uint32_t last;
+    options->firstId = last = strtoul(range, &end, 0);
+    if (end == range)
+      return 0;
+    if (*end == '-')
       {
-        printf("error: not found\n");
-        error();
+        range = end + 1;
+        last = strtoul(range, &end, 0);
+        if (end == range)
+          return 0;
       }
+    if (*end || last < options->firstId)
+      return 0;
+    options->idCount = last - options->firstId + 1;
+    return 1;
   }
 
 
-static void LocateCodeFile(void)
+/* --category 4,5,9 (the group byte of the actor overlay's info) */
+static int ParseCategories(Z64Options *options, const char *list)
   {
-    printf("locating code file...        ");
-    uint32_t i = 0;
-    FileTableEntry fte;
-    for (i = 0; i < rom.fileTable.size / 16; i++)
+    char *end;
+    uint32_t group;
+    options->categories = 0;
+    for (;;)
       {
-        if (GetFile(&fte, i))
-          {
-            switch (GetFileType(fte.data, fte.size))
-              {
-                case ZASM:
-                  {
-                    if (!code.virtual.start)
-                      memcpy(&code, &fte, sizeof(FileTableEntry));
-                    else if (fte.physical.end)
-                      free(fte.data);
-                    break;
-                  }
-                case ZACTOR:
-                  {
-                    if (rom.ac < 3)
-                      memcpy(&actor[rom.ac++], &fte, 16);
-                    else
-                      rom.ac++;
-                    if (fte.physical.end)
-                      free(fte.data);
-                    break;
-                  }
-                case ZOBJ:
-                  {
-                    if (rom.oc < 3)
-                      memcpy(&object[rom.oc++], &fte, 16);
-                    else
-                      rom.oc++;
-                    if (fte.physical.end)
-                      free(fte.data);
-                    break;
-                  }
-                case ZSCENE:
-                  {
-                    if (rom.sc < 3)
-                      memcpy(&scene[rom.sc++], &fte, 16);
-                    else
-                      rom.sc++;
-                    if (fte.physical.end)
-                      free(fte.data);
-                    break;
-                  }
-              }
-            if (rom.ac >= 3 && rom.oc >= 3 && rom.sc >= 3)
-              break;
-          }
+        group = strtoul(list, &end, 0);
+        if (end == list || group > 31)
+          return 0;
+        options->categories |= 1u << group;
+        if (!*end)
+          return 1;
+        if (*end != ',')
+          return 0;
+        list = end + 1;
       }
-    if (code.virtual.start)
-      printf("found [%08X - %08X]\n", code.virtual.start, code.virtual.end);
-    else
+  }
+
+
+/* A single rom is extracted just like before.  In a batch every rom gets a
+ * root of its own named after the file (minus its extension), made unique
+ * with a -N suffix when two roms share a name.
+ */
+static const char *BaseName(const char *path)
+  {
+    const char *name = path;
+    for (; *path; path++)
       {
-        printf("error: not found\n");
-        error();
+        if (*path == '/' || *path == '\\')
+          name = path + 1;
       }
+    return name;
   }
 
 
-static void LocateFileNameTable(void)
+/* puts the file name of path into root; no path leaves buffer empty */
+static int RootFile(char buffer[512], const char *root, const char *path)
   {
-    printf("locating file name table...  ");
-    uint32_t i;
-    for (i = 0; i < rom.size - 4; i += 4)
+    uint32_t rootLength, pathLength;
+    if (!path)
+      return 1;
+    path = BaseName(path);
+    rootLength = strlen(root);
+    pathLength = strlen(path);
+    if (rootLength + pathLength + 2 > 512)
+      return 0;
+    memcpy(buffer, root, rootLength);
+    buffer[rootLength] = '/';
+    memcpy(&buffer[rootLength + 1], path, pathLength + 1);
+    return 1;
+  }
+
+
+static int SetBatchOutput(Batch *batch)
+  {
+    const char *output = batch->options.output ? batch->options.output : ".", *name, *p;
+    BatchRom *entry;
+    uint32_t i, j, n, length, copies;
+    if (batch->count == 1)
+      return 1;
+    for (i = 0; i < batch->count; i++)
       {
-        if (READ32(&rom.data[i]) == 0x6D616B65 && READ32(&rom.data[i + 4]) == 0x726F6D00)
+        entry = &batch->roms[i];
+        name = BaseName(entry->filename);
+        p = strrchr(name, '.');
+        length = p && p != name ? p - name : strlen(name);
+        if (strlen(output) + length + 16 > sizeof(entry->root))
+          return 0;
+        n = sprintf(entry->root, "%s/%.*s", output, (int) length, name);
+        for (j = 0, copies = 1; j < i; j++)
           {
-            rom.fileNameTable = i;
-            printf("found [%08X]\n", rom.fileNameTable);
-            return;
+            if (!strcmp(batch->roms[j].root, entry->root))
+              {
+                sprintf(&entry->root[n], "-%i", ++copies);
+                j = -1;
+              }
           }
+        if (!RootFile(entry->archive, entry->root, batch->options.archive) ||
+            !RootFile(entry->listJson, entry->root, batch->listJson) ||
+            !RootFile(entry->listCsv, entry->root, batch->listCsv) ||
+            !RootFile(entry->rebuild, entry->root, batch->rebuild) ||
+            !RootFile(entry->statsFile, entry->root, batch->statsFile))
+          return 0;
       }
-    printf("N/A\n");
+    return 1;
   }
 
 
-static void LocateSceneTable(void)
+/* Runs on the shared pool, so the roms of a batch are extracted side by
+ * side and their scene, actor and object tasks all go through the same
+ * queues.  Each rom logs to a temporary file that is printed in one piece
+ * once the rom is done.
+ */
+static void ProcessRom(void *arg, uint32_t index)
   {
-    printf("locating scene table...      ");
-    uint32_t i, w0, w1;
-    FileTableEntry fte;
-    if (rom.sc < 3)
+    Batch *batch = (Batch *) arg;
+    BatchRom *entry = &batch->roms[index];
+    Z64Options options = batch->options;
+    Z64Rom *rom;
+    FILE *log = batch->count > 1 ? tmpfile() : NULL;
+    char buffer[4096];
+    size_t n;
+    if (batch->count > 1)
       {
-        printf("error: not found\n");
-        error();
+        options.output = entry->root;
+        options.archive = *entry->archive ? entry->archive : NULL;
       }
-    scene[0].physical.start = scene[1].physical.start = scene[2].physical.start = 0;
-    for (i = 0; i < code.size - 4; i += 4)
+    if ((entry->status = Z64Open(&rom, entry->filename, log ? log : stdout)) == Z64_OK)
       {
-        w0 = READ32(&code.data[i]);
-        w1 = READ32(&code.data[i + 4]);
-        if (w0 == scene[0].virtual.start && w1 == scene[0].virtual.end)
-          {
-            scene[0].physical.start = i;
-            i += rom.steSize - 4;
-          }
-        else if (w0 == scene[1].virtual.start && w1 == scene[1].virtual.end)
+        Z64SetCacheSize(rom, batch->cacheSize);
+        if (!batch->noIndex && strlen(entry->filename) < sizeof(buffer) - 6)
           {
-            scene[1].physical.start = i;
-            i += rom.steSize - 4;
+            sprintf(buffer, "%s.index", entry->filename);
+            Z64SetIndexFile(rom, buffer);
           }
-        else if (w0 == scene[2].virtual.start && w1 == scene[2].virtual.end)
+        if ((entry->status = Z64Locate(rom)) == Z64_OK)
           {
-            scene[2].physical.start = i;
-            i += rom.steSize - 4;
+            if (batch->list)
+              entry->status = ListRom(batch, entry, rom, log ? log : stdout);
+            else if (batch->rebuild)
+              entry->status = Z64Rebuild(rom, &options,
+                                         *entry->rebuild ? entry->rebuild : batch->rebuild);
+            else
+              entry->status = Z64Extract(rom, &options);
           }
-        if (scene[0].physical.start && scene[1].physical.start && scene[2].physical.start)
-          break;
+        if (batch->stats && ReportStats(batch, entry, rom, log ? log : stdout) &&
+            entry->status == Z64_OK)
+          entry->status = Z64_ERROR_OUTPUT;
+        Z64Close(rom);
       }
-    if (!scene[0].physical.start && !scene[1].physical.start && !scene[2].physical.start)
-      {
-        printf("error: not found\n");
-        error();
-      }
-    scene[0].physical.end = scene[0].physical.start < scene[1].physical.start ?
-                            scene[0].physical.start : scene[1].physical.start;
-    scene[0].physical.end = scene[0].physical.end < scene[2].physical.start ?
-                            scene[0].physical.end : scene[2].physical.start;
-    scene[2].physical.end = scene[0].physical.start > scene[1].physical.start ?
-                            scene[0].physical.start : scene[1].physical.start;
-    scene[2].physical.end = scene[2].physical.end > scene[2].physical.start ?
-                            scene[2].physical.end : scene[2].physical.start;
-    if (scene[0].physical.start > scene[0].physical.end &&
-        scene[0].physical.start < scene[2].physical.end)
-      scene[1].physical.end = scene[0].physical.start;
-    else if (scene[1].physical.start > scene[0].physical.end &&
-             scene[1].physical.start < scene[2].physical.end)
-      scene[1].physical.end = scene[1].physical.start;
-    else if (scene[2].physical.start > scene[0].physical.end &&
-             scene[2].physical.start < scene[2].physical.end)
-      scene[1].physical.end = scene[2].physical.start;
-    if (!scene[0].physical.end)
-      scene[0].physical.end = scene[1].physical.end;
-    if (!scene[0].physical.end)
-      scene[0].physical.end = scene[2].physical.end;
-    if (!scene[0].physical.end ||
-        ((scene[1].physical.end - scene[0].physical.end) % rom.steSize) ||
-        ((scene[2].physical.end - scene[1].physical.end) % rom.steSize))
-      {
-        printf("error: not found\n");
-        error();
-      }
-    i = scene[0].physical.end;
-    while (i)
+    if (batch->count < 2)
+      return;
+    MutexLock(&batch->lock);
+    printf("==> %s\n", entry->filename);
+    if (log)
       {
-        w0 = READ32(&code.data[i]);
-        w1 = READ32(&code.data[i + 4]);
-        if (!w0 || GetFileNumber(w0, w1) >= 0)
-          i -= rom.steSize;
-        else
-          break;
+        rewind(log);
+        while (n = fread(buffer, 1, sizeof(buffer), log))
+          fwrite(buffer, 1, n, stdout);
+        fclose(log);
       }
-    rom.sceneTable.start = i + rom.steSize;
-    printf("found [%08X]\n", code.virtual.start + rom.sceneTable.start);
+    if (entry->status == Z64_OK)
+      printf("==> %s: ok [%s]\n\n", entry->filename, entry->root);
+    else
+      printf("==> %s: failed (%s)\n\n", entry->filename, Z64ErrorString(entry->status));
+    fflush(stdout);
+    MutexUnlock(&batch->lock);
   }
 
 
-static void LocateObjectTable(void)
+/* The text catalog goes to the log so a batch keeps it with its rom; json
+ * and csv go to the --list-* files (inside the rom's root in a batch).
+ */
+static int ListFile(Batch *batch, BatchRom *entry, Z64Rom *rom, FILE *log, const char *filename,
+                    int format)
   {
-    printf("locating object table...     ");
-    uint32_t i, w0, w1;
-    FileTableEntry fte;
-    if (rom.oc < 3)
-      {
-        printf("error: not found\n");
-        error();
-      }
-    object[0].physical.start = object[1].physical.start = object[2].physical.start = 0;
-    for (i = 0; i < code.size - 4; i += 4)
+    FILE *out;
+    int status;
+    if ((batch->count > 1 && !MakeDirectories(entry->root)) || !(out = fopen(filename, "w")))
       {
-        w0 = READ32(&code.data[i]);
-        w1 = READ32(&code.data[i + 4]);
-        if (w0 == object[0].virtual.start && w1 == object[0].virtual.end)
-          {
-            object[0].physical.start = i;
-            i += rom.steSize - 4;
-          }
-        else if (w0 == object[1].virtual.start && w1 == object[1].virtual.end)
-          {
-            object[1].physical.start = i;
-            i += rom.steSize - 4;
-          }
-        else if (w0 == object[2].virtual.start && w1 == object[2].virtual.end)
-          {
-            object[2].physical.start = i;
-            i += rom.steSize - 4;
-          }
-        if (object[0].physical.start && object[1].physical.start && object[2].physical.start)
-          break;
+        fprintf(log, "ERROR:  Failed to create '%s'\n", filename);
+        return Z64_ERROR_OUTPUT;
       }
-    if (!object[0].physical.start)
-      object[0] = object[1];
-    if (!object[0].physical.start)
-      object[0] = object[2];
-    if (!object[0].physical.start)
+    status = Z64List(rom, &batch->options, out, format);
+    if (fclose(out) && status == Z64_OK)
+      status = Z64_ERROR_OUTPUT;
+    if (status == Z64_OK)
+      fprintf(log, "catalog written to '%s'\n", filename);
+    return status;
+  }
+
+
+static int ListRom(Batch *batch, BatchRom *entry, Z64Rom *rom, FILE *log)
+  {
+    int status = Z64_OK;
+    if (batch->listText)
+      status = Z64List(rom, &batch->options, log, Z64_LIST_TEXT);
+    if (status == Z64_OK && batch->listJson)
+      status = ListFile(batch, entry, rom, log, *entry->listJson ? entry->listJson : batch->listJson,
+                        Z64_LIST_JSON);
+    if (status == Z64_OK && batch->listCsv)
+      status = ListFile(batch, entry, rom, log, *entry->listCsv ? entry->listCsv : batch->listCsv,
+                        Z64_LIST_CSV);
+    return status;
+  }
+
+
+static double Rate(uint64_t bytes, double seconds)
+  {
+    return seconds > 0 ? bytes / seconds / 1048576.0 : 0;
+  }
+
+
+static void PrintStats(FILE *out, const Z64Stats *stats)
+  {
+    double wall = 0, cpu = 0;
+    int i;
+    fprintf(out, "stats:\n");
+    for (i = 0; i < Z64_STAGES; i++)
       {
-        printf("error: not found\n");
-        error();
+        if (!stats->wall[i])
+          continue;
+        fprintf(out, "  %-16s %9.3f s wall %9.3f s cpu\n", Z64StageName(i), stats->wall[i],
+                stats->cpu[i]);
+        wall += stats->wall[i];
+        cpu += stats->cpu[i];
       }
-    i = object[0].physical.start;
-    while (i)
+    fprintf(out, "  %-16s %9.3f s wall %9.3f s cpu\n", "total", wall, cpu);
+    fprintf(out, "  scanned          %.1f MB\n", stats->scanned / 1048576.0);
+    fprintf(out, "  decompressed     %llu files, %.1f MB -> %.1f MB in %.3f s (%.1f MB/s)\n",
+            (unsigned long long) stats->decoded, stats->decodedIn / 1048576.0,
+            stats->decodedOut / 1048576.0, stats->decodeTime,
+            Rate(stats->decodedOut, stats->decodeTime));
+    fprintf(out, "  written          %llu files, %.1f MB in %.3f s (%.1f MB/s)\n",
+            (unsigned long long) stats->written, stats->writtenBytes / 1048576.0,
+            stats->writeTime, Rate(stats->writtenBytes, stats->writeTime));
+    fprintf(out, "  cache            %llu hits, %llu misses, peak %.1f MB\n",
+            (unsigned long long) stats->cacheHits, (unsigned long long) stats->cacheMisses,
+            stats->peakCache / 1048576.0);
+    fprintf(out, "  peak memory      %.1f MB buffers, %.1f MB rss\n",
+            stats->peakBuffers / 1048576.0, stats->peakRss / 1048576.0);
+  }
+
+
+static void PrintStatsJson(FILE *out, const char *filename, const Z64Stats *stats)
+  {
+    int i;
+    fprintf(out, "{\n  \"rom\": ");
+    PrintJsonString(out, filename);
+    fprintf(out, ",\n  \"stages\": {");
+    for (i = 0; i < Z64_STAGES; i++)
       {
-        w0 = READ32(&code.data[i]);
-        if (!w0 || GetFileNumber(w0, 0) >= 0)
-          i -= 8;
-        else
-          break;
+        fprintf(out, "%s\n    \"%s\": {\"wall\": %.6f, \"cpu\": %.6f}", i ? "," : "",
+                Z64StageName(i), stats->wall[i], stats->cpu[i]);
       }
-    rom.objectTable.start = i + 8;
-    printf("found [%08X]\n", code.virtual.start + rom.objectTable.start);
+    fprintf(out, "\n  },\n  \"scannedBytes\": %llu,\n  \"decompressedFiles\": %llu,\n"
+            "  \"compressedBytes\": %llu,\n  \"decompressedBytes\": %llu,\n"
+            "  \"decompressSeconds\": %.6f,\n  \"decompressMBps\": %.3f,\n"
+            "  \"writtenFiles\": %llu,\n  \"writtenBytes\": %llu,\n  \"writeSeconds\": %.6f,\n"
+            "  \"cacheHits\": %llu,\n  \"cacheMisses\": %llu,\n  \"peakCacheBytes\": %llu,\n"
+            "  \"peakBufferBytes\": %llu,\n  \"peakRssBytes\": %llu\n}\n",
+            (unsigned long long) stats->scanned, (unsigned long long) stats->decoded,
+            (unsigned long long) stats->decodedIn, (unsigned long long) stats->decodedOut,
+            stats->decodeTime, Rate(stats->decodedOut, stats->decodeTime),
+            (unsigned long long) stats->written, (unsigned long long) stats->writtenBytes,
+            stats->writeTime, (unsigned long long) stats->cacheHits,
+            (unsigned long long) stats->cacheMisses, (unsigned long long) stats->peakCache,
+            (unsigned long long) stats->peakBuffers, (unsigned long long) stats->peakRss);
   }
 
 
-static void LocateActorTable(void)
+/* --stats prints to the log like everything else, --stats-json writes its
+ * own file; both can be given.  Returns nonzero if that file couldn't be
+ * written.
+ */
+static int ReportStats(Batch *batch, BatchRom *entry, Z64Rom *rom, FILE *log)
   {
-    printf("locating actor table...      ");
-    uint32_t i, w0, w1;
-    FileTableEntry fte;
-    if (rom.ac < 3)
+    const char *filename = *entry->statsFile ? entry->statsFile : batch->statsFile;
+    Z64Stats stats;
+    FILE *out;
+    int failed;
+    Z64GetStats(rom, &stats);
+    if (batch->statsText)
+      PrintStats(log, &stats);
+    if (!filename)
+      return 0;
+    if ((batch->count > 1 && !MakeDirectories(entry->root)) || !(out = fopen(filename, "w")))
       {
-        printf("error: not found\n");
-        error();
+        fprintf(log, "ERROR:  Failed to create '%s'\n", filename);
+        return 1;
       }
-    actor[0].physical.start = actor[1].physical.start = actor[2].physical.start = 0;
-    for (i = 0; i < code.size - 4; i += 4)
+    PrintStatsJson(out, entry->filename, &stats);
+    failed = ferror(out);
+    failed = fclose(out) || failed;
+    if (failed)
+      fprintf(log, "ERROR:  Failed to write '%s'\n", filename);
+    return failed;
+  }
+
+
+static void FreeBatch(Batch *batch)
+  {
+    uint32_t i;
+    for (i = 0; i < batch->count; i++)
+      free(batch->roms[i].filename);
+    free(batch->roms);
+  }
+#endif
+
+
+
+int Z64Init(uint32_t jobs)
+  {
+    GetByteswapKernel();
+    BufferPoolInit();
+    if (!PoolStart(jobs))
       {
-        w0 = READ32(&code.data[i]);
-        w1 = READ32(&code.data[i + 4]);
-        if (w0 == actor[0].virtual.start && w1 == actor[0].virtual.end)
-          {
-            actor[0].physical.start = i;
-            i += rom.steSize - 4;
-          }
-        else if (w0 == actor[1].virtual.start && w1 == actor[1].virtual.end)
-          {
-            actor[1].physical.start = i;
-            i += rom.steSize - 4;
-          }
-        else if (w0 == actor[2].virtual.start && w1 == actor[2].virtual.end)
-          {
-            actor[2].physical.start = i;
-            i += rom.steSize - 4;
-          }
-        if (actor[0].physical.start && actor[1].physical.start && actor[2].physical.start)
-          break;
+        BufferPoolFree();
+        return 0;
       }
-    if (!actor[0].physical.start)
-      actor[0] = actor[1];
-    if (!actor[0].physical.start)
-      actor[0] = actor[2];
-    if (!actor[0].physical.start)
+    return 1;
+  }
+
+
+void Z64Shutdown(void)
+  {
+    PoolStop();
+    BufferPoolFree();
+  }
+
+
+int Z64Open(Z64Rom **rom, const char *filename, FILE *log)
+  {
+    Rom *r;
+    *rom = NULL;
+    if (!(r = (Rom *) calloc(1, sizeof(Rom))) || !(r->filename = strdup(filename)))
       {
-        printf("error: not found\n");
-        error();
+        if (log)
+          fprintf(log, "ERROR:  Failed to allocate memory\n");
+        free(r);
+        return Z64_ERROR_MEMORY;
       }
-    i = actor[0].physical.start;
-    while (i)
+    r->log = log;
+    r->cache.budget = 64 << 20;
+    if (!LoadRom(r))
       {
-        w0 = READ32(&code.data[i]);
-        if (!w0 || GetFileNumber(w0, 0) >= 0)
-          i -= 32;
-        else
-          break;
+        free(r->filename);
+        free(r);
+        return Z64_ERROR_OPEN;
       }
-    rom.actorTable.start = i + 32;
-    printf("found [%08X]\n", code.virtual.start + rom.actorTable.start);
+    *rom = r;
+    return Z64_OK;
   }
 
 
-static void ExtractScenesAndMaps(void)
+/* path of the index sidecar; NULL disables it */
+void Z64SetIndexFile(Z64Rom *rom, const char *path)
   {
-    printf("extracting scenes and maps...");
-    uint32_t i, j, w0, w1, start, end, totalScenes = 0, totalMaps = 0;
-    int32_t fileNum;
-    char filePath[512];
-    FILE *fp;
-    FileTableEntry fte, map;
-    mkdir("data");
-    mkdir("data/scenes");
-    for (i = rom.sceneTable.start; i < code.size; i += rom.steSize)
-      {
-        start = READ32(&code.data[i]);
-        end = READ32(&code.data[i + 4]);
-        if (start && (fileNum = GetFileNumber(start, end)) >= 0)
-          {
-            if (GetFile(&fte, fileNum))
-              {
-                sprintf(filePath, "data/scenes/%03i", (i - rom.sceneTable.start)  / rom.steSize);
-                mkdir(filePath);
-                filePath[15] = '/';
-                GetFileName(&filePath[16], fileNum);
-                sprintf(&filePath[strlen(filePath)], ".zscene");
-                if (fp = fopen(filePath, "wb"))
-                  {
-                    fwrite(fte.data, 1, fte.size, fp);
-                    fclose(fp);
-                    totalScenes++;
-                  }
-                sprintf(&filePath[15], "/maps");
-                for (j = 0; j + 7 < fte.size; j += 8)
-                  {
-                    w0 = READ32(&fte.data[j]);
-                    w1 = READ32(&fte.data[j + 4]);
-                    if ((w0 & 0xFF000000) == 0x04000000)
-                      {
-                        uint32_t k, mapCount = (w0 >> 16) & 0xFF;
-                        uint32_t mapList = w1 & 0x00FFFFFF;
-                        totalMaps += mapCount;
-                        for (k = 0; k < mapCount; k++)
-                          {
-                            w0 = READ32(&fte.data[mapList + k * 8]);
-                            w1 = READ32(&fte.data[mapList + k * 8 + 4]);
-                            fileNum = GetFileNumber(w0, 0);
-                            if (fileNum >= 0 && GetFile(&map, fileNum))
-                              {
-                                filePath[20] = 0;
-                                mkdir(filePath);
-                                filePath[20] = '/';
-                                GetFileName(&filePath[21], fileNum);
-                                sprintf(&filePath[strlen(filePath)], ".zmap");
-                                if (fp = fopen(filePath, "wb"))
-                                  {
-                                    fwrite(map.data, 1, map.size, fp);
-                                    fclose(fp);
-                                  }
-                                if (map.physical.end)
-                                  free(map.data);
-                              }
-                          }
-                      }
-                    else if (w0 == 0x14000000)
-                      break;
-                  }
-                if (fte.physical.end)
-                  free(fte.data);
-              }
-          }
-        else if (start)
-          break;
-      }
-    printf("ok    [%i/%i scenes, %i maps]\n", totalScenes, (i - rom.sceneTable.start)  / rom.steSize, totalMaps);
+    free(rom->indexFile);
+    rom->indexFile = path ? strdup(path) : NULL;
   }
 
 
-static void ExtractActors(void)
+/* can be changed at any time; the cache shrinks as files are released */
+void Z64SetCacheSize(Z64Rom *rom, uint64_t bytes)
   {
-    printf("extracting actors...         ");
-    uint32_t i, j, w0, w1, start, end, info, totalActors = 0;
-    int32_t fileNum;
-    char filePath[512];
-    FILE *fp;
-    FileTableEntry fte, map;
-    mkdir("data");
-    mkdir("data/actors");
-    strcpy(filePath, "data/actors/");
-    for (i = rom.actorTable.start; i < code.size; i += 32)
-      {
-        start = READ32(&code.data[i]);
-        end = READ32(&code.data[i + 4]);
-        info = READ32(&code.data[i + 20]) - READ32(&code.data[i + 8]);
-        if (start && (fileNum = GetFileNumber(start, end)) >= 0)
-          {
-            if (GetFile(&fte, fileNum))
-              {
-                filePath[12] = 0;
-                switch (fte.data[info + 2]) {
-                    case 1:
-                        strcat(filePath, "props (1)");
-                        break;
-                    case 2:
-                        strcat(filePath, "player");
-                        break;
-                    case 3:
-                        strcat(filePath, "bombs");
-                        break;
-                    case 4:
-                        strcat(filePath, "npcs");
-                        break;
-                    case 5:
-                        strcat(filePath, "enemies");
-                        break;
-                    case 6:
-                        strcat(filePath, "props (2)");
-                        break;
-                    case 7:
-                        strcat(filePath, "items and actions");
-                        break;
-                    case 8:
-                        strcat(filePath, "misc");
-                        break;
-                    case 9:
-                        strcat(filePath, "bosses");
-                        break;
-                    case 10:
-                        strcat(filePath, "doors");
-                        break;
-                    case 11:
-                        strcat(filePath, "chests");
-                        break;
-                    default:
-                        sprintf(filePath + strlen(filePath), "unknown group %02X", fte.data[info + 2]);
-                        break;
-                }
-                mkdir(filePath);
-                sprintf(filePath + strlen(filePath), "/%03X [obj %03X] - ", (i - rom.actorTable.start) / 32, (fte.data[info + 8] << 8) | fte.data[info + 9]);
-                GetFileName(filePath + strlen(filePath), fileNum);
-                sprintf(filePath + strlen(filePath), ".zactor");
-                if (fp = fopen(filePath, "wb"))
-                  {
-                    fwrite(fte.data, 1, fte.size, fp);
-                    fclose(fp);
-                    totalActors++;
-                  }
-                if (fte.physical.end)
-                  free(fte.data);
-              }
-          }
-        else if (start)
-          break;
+    if (rom->cache.entries)
+      MutexLock(&rom->cache.lock);
+    rom->cache.budget = bytes;
+    if (rom->cache.entries)
+      {
+        CacheTrim(rom);
+        MutexUnlock(&rom->cache.lock);
       }
-    printf("ok    [%i/%i actors]\n", totalActors, (i - rom.actorTable.start)  / 32);
   }
 
 
-static void ExtractObjects(void)
+/* Fixes the byte order and finds the file table, code and the scene, object
+ * and actor tables, stopping at the first one that can't be found.
+ */
+int Z64Locate(Z64Rom *rom)
   {
-    printf("extracting objects...        ");
-    uint32_t i, j, w0, w1, start, end, totalObjects = 0;
-    int32_t fileNum;
-    char filePath[512];
-    FILE *fp;
-    FileTableEntry fte, map;
-    mkdir("data");
-    mkdir("data/objects");
-    for (i = rom.objectTable.start; i < code.size; i += 8)
+    StageClock clock;
+    int status;
+    if (rom->located)
+      return Z64_OK;
+    StageStart(&clock);
+    if (!(status = Byteswap(rom)))
+      CheckRomType(rom);
+    StageLap(rom, Z64_STAGE_BYTESWAP, &clock);
+    if (status)
+      return status;
+    /* everything below comes from the index if it still matches the rom */
+    if (rom->indexFile && LoadIndex(rom))
       {
-        start = READ32(&code.data[i]);
-        end = READ32(&code.data[i + 4]);
-        if (start && (fileNum = GetFileNumber(start, end)) >= 0)
-          {
-            if (GetFile(&fte, fileNum))
-              {
-                if ((i - rom.objectTable.start) / 8 == 1)
-                  {
-                    sprintf(filePath, "data/gk_%03X - ", (i - rom.objectTable.start) / 8);
-                    GetFileName(&filePath[14], fileNum);
-                  }
-                else if ((i - rom.objectTable.start) / 8 == 2)
-                  {
-                    sprintf(filePath, "data/fk_%03X - ", (i - rom.objectTable.start) / 8);
-                    GetFileName(&filePath[14], fileNum);
-                  }
-                else if ((i - rom.objectTable.start) / 8 == 3)
-                  {
-                    sprintf(filePath, "data/dk_%03X - ", (i - rom.objectTable.start) / 8);
-                    GetFileName(&filePath[14], fileNum);
-                  }
-                else
-                  {
-                    sprintf(filePath, "data/objects/%03X - ", (i - rom.objectTable.start) / 8);
-                    GetFileName(&filePath[19], fileNum);
-                  }
-                sprintf(&filePath[strlen(filePath)], ".zobj");
-                if (fp = fopen(filePath, "wb"))
-                  {
-                    fwrite(fte.data, 1, fte.size, fp);
-                    fclose(fp);
-                    totalObjects++;
-                  }
-                if (fte.physical.end)
-                  free(fte.data);
-              }
-          }
-        else if (start)
-          break;
+        StageLap(rom, Z64_STAGE_FILE_TABLE, &clock);
+        rom->located = 1;
+        return Z64_OK;
       }
-    printf("ok    [%i/%i objects]\n", totalObjects, (i - rom.objectTable.start) / 8);
+    status = LocateFileTable(rom);
+    StageLap(rom, Z64_STAGE_FILE_TABLE, &clock);
+    if (status)
+      return status;
+    status = LocateCodeFile(rom);
+    StageLap(rom, Z64_STAGE_CODE_FILE, &clock);
+    if (status)
+      return status;
+    status = LocateFileNameTable(rom);
+    StageLap(rom, Z64_STAGE_NAME_TABLE, &clock);
+    if (status)
+      return status;
+    ScanCodeFile(rom);
+    if (!(status = LocateSceneTable(rom)) && !(status = LocateObjectTable(rom)))
+      status = LocateActorTable(rom);
+    StageLap(rom, Z64_STAGE_CODE_TABLES, &clock);
+    if (status)
+      return status;
+    rom->located = 1;
+    if (rom->indexFile)
+      SaveIndex(rom);
+    return Z64_OK;
   }
 
 
-static void yaz0dec(uint8_t *src, uint8_t *dst, uint32_t size)
+int Z64Extract(Z64Rom *rom, const Z64Options *options)
   {
-    uint32_t srcPos = 0, dstPos = 0, cpyPos, cpyLen, vb = 1, cb;
-    while (dstPos < size)
+    StageClock clock;
+    int status;
+    if (!rom->located)
+      return Z64_ERROR_NOT_LOCATED;
+    rom->options = *options;
+    StageStart(&clock);
+    if (status = WriterStart(rom, options))
+      return status;
+    if (Extracts(rom, Z64_EXTRACT_SCENES | Z64_EXTRACT_MAPS))
+      status = ExtractScenesAndMaps(rom);
+    StageLap(rom, Z64_STAGE_SCENES, &clock);
+    if (!status && Extracts(rom, Z64_EXTRACT_ACTORS))
+      status = ExtractActors(rom);
+    StageLap(rom, Z64_STAGE_ACTORS, &clock);
+    if (!status && Extracts(rom, Z64_EXTRACT_OBJECTS))
+      status = ExtractObjects(rom);
+    StageLap(rom, Z64_STAGE_OBJECTS, &clock);
+    if (!status && options->archive)
       {
-        if (cb <<= 1, vb--, !vb)
+        Log(rom, "writing archive index...     ");
+        if (!ArchiveFinish(rom))
           {
-            cb = src[srcPos++];
-            vb = 8;
+            Log(rom, "ERROR:  Failed to write '%s'\n", options->archive);
+            status = Z64_ERROR_OUTPUT;
           }
-        if (cb & 0x80)
-          dst[dstPos++] = src[srcPos++];
         else
+          Log(rom, "ok    [%i entries, %.1f MB]\n", rom->writer.entryCount,
+              rom->writer.offset / 1048576.0);
+      }
+    if (!status && rom->writer.incremental)
+      {
+        Log(rom, "writing manifest...          ");
+        if (!ManifestFinish(rom))
           {
-            cpyLen = src[srcPos++];
-            cpyPos = dstPos - (((cpyLen & 0x0F) << 8) | src[srcPos++]) - 1;
-            cpyLen = cpyLen >> 4 ? (cpyLen >> 4) + 2 : src[srcPos++] + 0x12;
-            for(; cpyLen; cpyLen--)
-              dst[dstPos++] = dst[cpyPos++];
+            Log(rom, "ERROR:  Failed to write '%s%s'\n", rom->writer.root, MANIFEST_FILE);
+            status = Z64_ERROR_OUTPUT;
           }
+        else
+          Log(rom, "ok    [%i unchanged, %i written]\n", rom->writer.unchanged,
+              rom->writer.rewritten);
       }
+    if (!status && options->dedup)
+      Log(rom, "dedup: %llu duplicate files, %.1f MB not written\n",
+          (unsigned long long) rom->writer.duplicates, rom->writer.saved / 1048576.0);
+    WriterStop(rom);
+    StageLap(rom, Z64_STAGE_FINISH, &clock);
+    return status;
   }
 
 
-static int GetFile(FileTableEntry *fte, int32_t index)
+/* Writes what Z64Extract(rom, options) would write, one row per file,
+ * without writing anything else.  Sizes of compressed files come from their
+ * Yaz0 header, so the only files decompressed are the scenes (for their
+ * map lists) and the actor overlays (for their group and object).
+ */
+int Z64List(Z64Rom *rom, const Z64Options *options, FILE *out, int format)
   {
-    if (index < 0 || index >= rom.fileTable.size / 16)
-      return 0;
-    READFTE(fte, &rom.data[rom.fileTable.start + index * 16]);
-    if (fte->virtual.end && fte->physical.end && fte->physical.start != 0xFFFFFFFF &&
-        fte->physical.end != 0xFFFFFFFF)
+    Catalog catalog = {out, format, 0};
+    StageClock clock;
+    if (!rom->located)
+      return Z64_ERROR_NOT_LOCATED;
+    rom->options = *options;
+    StageStart(&clock);
+    CatalogBegin(rom, &catalog);
+    if (Extracts(rom, Z64_EXTRACT_SCENES | Z64_EXTRACT_MAPS))
+      ListScenesAndMaps(rom, &catalog);
+    if (Extracts(rom, Z64_EXTRACT_ACTORS))
+      ListActors(rom, &catalog);
+    if (Extracts(rom, Z64_EXTRACT_OBJECTS))
+      ListObjects(rom, &catalog);
+    CatalogEnd(rom, &catalog);
+    StageLap(rom, Z64_STAGE_LIST, &clock);
+    return ferror(out) ? Z64_ERROR_OUTPUT : Z64_OK;
+  }
+
+
+/* Writes a copy of the rom to filename with the files under options->output
+ * (or in options->archive) that differ from the rom's own put back in.  The
+ * filters in options limit which files are looked for.
+ */
+int Z64Rebuild(Z64Rom *rom, const Z64Options *options, const char *filename)
+  {
+    Rebuild rebuild = {0};
+    StageClock clock;
+    char temp[1040];
+    uint32_t i, size = 0, count = rom->fileTable.size / 16, length;
+    uint8_t *out = NULL;
+    FILE *fp;
+    int status = Z64_OK, ok, checksum;
+    if (!rom->located)
+      return Z64_ERROR_NOT_LOCATED;
+    rom->options = *options;
+    rebuild.rom = rom;
+    StageStart(&clock);
+    Log(rom, "rebuilding...                ");
+    if (strlen(filename) > 1024)
+      {
+        Log(rom, "ERROR:  Output path too long\n");
+        return Z64_ERROR_OUTPUT;
+      }
+    if (options->archive)
       {
-        if (!strncmp(&rom.data[fte->physical.start], "Yaz0", 4))
+        if (!RebuildArchive(&rebuild, options->archive))
           {
-            fte->size = READ32(&rom.data[fte->physical.start + 4]);
-            fte->data = (uint8_t *) malloc(fte->size);
-            if (fte->data)
-              yaz0dec(&rom.data[fte->physical.start + 0x10], fte->data, fte->size);
-            else
-              return 0;
-            fte->physical.end = 0xFFFFFFFF;
+            Log(rom, "ERROR:  Failed to read '%s'\n", options->archive);
+            RebuildFree(&rebuild);
+            return Z64_ERROR_OPEN;
           }
-        else
+      }
+    else if (options->output && *options->output)
+      {
+        if ((length = strlen(options->output)) + 2 > sizeof(rebuild.root))
           {
-            fte->size = fte->virtual.end - fte->virtual.start;
-            fte->data = &rom.data[fte->physical.start];
-            fte->physical.end = 0x00000000;
+            Log(rom, "ERROR:  Output path too long\n");
+            return Z64_ERROR_OUTPUT;
           }
+        memcpy(rebuild.root, options->output, length);
+        if (rebuild.root[length - 1] != '/')
+          rebuild.root[length++] = '/';
+        rebuild.root[length] = 0;
       }
-    else if (fte->virtual.end && fte->physical.start != 0xFFFFFFFF &&
-             (!fte->physical.end || (fte->physical.end && fte->physical.end != 0xFFFFFFFF &&
-             (fte->physical.end - fte->physical.start == fte->virtual.end - fte->virtual.start))))
+    if (!(rebuild.files = (RebuildFile *) calloc(count ? count : 1, sizeof(RebuildFile))) ||
+        !RebuildPaths(&rebuild))
       {
-        fte->size = fte->virtual.end - fte->virtual.start;
-        fte->data = &rom.data[fte->physical.start];
-        fte->physical.end = 0x00000000;
+        Log(rom, "ERROR:  Failed to allocate memory\n");
+        RebuildFree(&rebuild);
+        return Z64_ERROR_MEMORY;
+      }
+    qsort(rebuild.paths, rebuild.pathCount, sizeof(RebuildPath), CompareRebuildPaths);
+    for (i = 0; i < rebuild.pathCount; i++)
+      {
+        if (!rebuild.files[rebuild.paths[i].file].paths++)
+          rebuild.files[rebuild.paths[i].file].path = i;
+      }
+    MutexInit(&rebuild.lock);
+    ParallelFor(count, RebuildRead, &rebuild);
+    MutexDestroy(&rebuild.lock);
+    for (i = 0; i < count; i++)
+      rebuild.replaced += rebuild.files[i].raw != NULL;
+    if (RebuildPatch(&rebuild))
+      ParallelFor(count, RebuildPack, &rebuild);
+    if (rebuild.status == Z64_OK && !(out = RebuildLayout(&rebuild, &size)))
+      rebuild.status = Z64_ERROR_MEMORY;
+    if (rebuild.status != Z64_OK)
+      {
+        Log(rom, "ERROR:  %s\n", rebuild.status == Z64_ERROR_MEMORY ? "Failed to allocate memory" :
+            "Failed to decompress a file the rebuild has to patch");
+        RebuildFree(&rebuild);
+        return rebuild.status;
+      }
+    checksum = RebuildChecksum(rom, out, size);
+    /* written next to filename first, which may well be the rom itself */
+    sprintf(temp, "%s.new", filename);
+    ok = (fp = fopen(temp, "wb")) != NULL;
+    if (ok)
+      {
+        ok = fwrite(out, 1, size, fp) == size;
+        ok = !fclose(fp) && ok;
+      }
+#ifdef _WIN32
+    if (ok)
+      remove(filename);
+#endif
+    if (!ok || rename(temp, filename))
+      {
+        remove(temp);
+        Log(rom, "ERROR:  Failed to write '%s'\n", filename);
+        status = Z64_ERROR_OUTPUT;
       }
     else
-      return 0;
-    return 1;
+      Log(rom, "ok    [%u replaced, %u moved, %.1f MB%s]\n", rebuild.replaced, rebuild.moved,
+          size / 1048576.0, checksum ? "" : ", no checksum");
+    free(out);
+    RebuildFree(&rebuild);
+    StageLap(rom, Z64_STAGE_FINISH, &clock);
+    return status;
   }
 
 
-static int GetFileNumber(uint32_t start, uint32_t end)
+void Z64Close(Z64Rom *rom)
   {
-    int i;
-    FileTableEntry fte;
-    for (i = rom.fileTable.start; i < rom.fileTable.start + rom.fileTable.size; i += 16)
-      {
-        READFTE(&fte, &rom.data[i]);
-        if (fte.virtual.start == start && (!end || (end && fte.virtual.end == end)))
-          return (i - rom.fileTable.start) / 16;
-      }
-    return -1;
+    if (!rom)
+      return;
+    WriterStop(rom);
+    PutFile(rom, &rom->code);
+    CacheFree(rom);
+    free(rom->fileTypes);
+    free(rom->vromIndex);
+    free(rom->fileNames);
+    UnloadRom(rom);
+    free(rom->indexFile);
+    free(rom->filename);
+    free(rom);
   }
 
 
-static void GetFileName(char *buffer, int32_t index)
+const char *Z64ErrorString(int error)
   {
-    if (index < 0 || index >= rom.fileTable.size / 16)
-      {
-        *buffer = 0;
-        return;
-      }
-    uint32_t i, j = 0;
-    FileTableEntry fte;
-    if (rom.fileNameTable)
-      {
-        for (i = 0; i < rom.fileTable.size / 16; i++)
-          {
-            for (; !rom.data[rom.fileNameTable + j]; j++);
-            if (i == index)
-              {
-                sprintf(buffer, "%s", &rom.data[rom.fileNameTable + j]);
-                break;
-              }
-            else
-              {
-                for (; rom.data[rom.fileNameTable + j]; j++);
-              }
-          }
-      }
-    else
+    switch (error)
       {
-        READFTE(&fte, &rom.data[rom.fileTable.start + index * 16]);
-        sprintf(buffer, "%08X - %08X", fte.virtual.start, fte.virtual.end);
+        case Z64_OK:			return "ok";
+        case Z64_ERROR_OPEN:		return "failed to open the rom";
+        case Z64_ERROR_MEMORY:		return "out of memory";
+        case Z64_ERROR_ENDIANNESS:	return "unknown endianness";
+        case Z64_ERROR_FILE_TABLE:	return "file table not found";
+        case Z64_ERROR_CODE_FILE:	return "code file not found";
+        case Z64_ERROR_SCENE_TABLE:	return "scene table not found";
+        case Z64_ERROR_OBJECT_TABLE:	return "object table not found";
+        case Z64_ERROR_ACTOR_TABLE:	return "actor table not found";
+        case Z64_ERROR_THREADS:		return "failed to start a thread";
+        case Z64_ERROR_OUTPUT:		return "failed to write the output";
+        case Z64_ERROR_NOT_LOCATED:	return "the rom hasn't been located";
+        case Z64_ERROR_DECODE:		return "failed to decompress a file";
       }
+    return "unknown error";
   }
 
 
-static int GetFileType(uint8_t *data, uint32_t size)
+void Z64GetStats(Z64Rom *rom, Z64Stats *stats)
   {
-    const uint8_t codesig[] =
+#ifdef _WIN32
+    PROCESS_MEMORY_COUNTERS memory;
+#else
+    struct rusage usage;
+#endif
+    *stats = rom->stats;
+    if (rom->cache.entries)
+      MutexLock(&rom->cache.lock);
+    stats->cacheHits = rom->cache.hits;
+    stats->cacheMisses = rom->cache.misses;
+    stats->peakCache = rom->cache.peak;
+    if (rom->cache.entries)
+      MutexUnlock(&rom->cache.lock);
+    MutexLock(&buffers.lock);
+    stats->peakBuffers = buffers.peak;
+    MutexUnlock(&buffers.lock);
+#ifdef _WIN32
+    stats->peakRss = GetProcessMemoryInfo(GetCurrentProcess(), &memory, sizeof(memory)) ?
+                     memory.PeakWorkingSetSize : 0;
+#else
+    /* ru_maxrss is in kilobytes on linux and in bytes on the bsds */
+    stats->peakRss = getrusage(RUSAGE_SELF, &usage) ? 0 : (uint64_t) usage.ru_maxrss;
+#ifdef __linux__
+    stats->peakRss <<= 10;
+#endif
+#endif
+  }
+
+
+const char *Z64StageName(int stage)
+  {
+    static const char *names[Z64_STAGES] =
       {
-        0x18, 0xF9, 0x6A, 0x6E, 0xB8, 0xE3, 0x82, 0x76,
-        0x47, 0x1D, 0x18, 0xF9, 0x82, 0x76, 0x6A, 0x6E,
-        0x6A, 0x6E, 0x82, 0x76, 0xE7, 0x07, 0xB8, 0xE3,
-        0x7D, 0x8A, 0x47, 0x1D, 0x6A, 0x6E, 0x18, 0xF9
+        "byteswap", "file table", "code file", "name table", "code tables",
+        "scenes and maps", "actors", "objects", "finish", "list"
       };
-    if (size < 8)
-      return ZDATA;
-    if (size > 32 && !memcmp(&data[size - 32], codesig, 32))
-      return ZASM;
-    uint32_t tlen = READ32(&data[size - 4]);
-    if (tlen >= 0x18 && tlen < size)
+    return stage >= 0 && stage < Z64_STAGES ? names[stage] : "unknown";
+  }
+
+
+int Z64IsMajorasMask(const Z64Rom *rom)
+  {
+    return rom->isMM;
+  }
+
+
+uint32_t Z64GetFileCount(const Z64Rom *rom)
+  {
+    return rom->fileTable.size / 16;
+  }
+
+
+static uint32_t GetTableStride(Rom *rom, int table, uint32_t *start)
+  {
+    switch (table)
+      {
+        case Z64_SCENES:
+          *start = rom->sceneTable.start;
+          return rom->steSize;
+        case Z64_OBJECTS:
+          *start = rom->objectTable.start;
+          return 8;
+        case Z64_ACTORS:
+          *start = rom->actorTable.start;
+          return 32;
+      }
+    return 0;
+  }
+
+
+uint32_t Z64GetTableLength(Z64Rom *rom, int table)
+  {
+    uint32_t start, stride = GetTableStride(rom, table, &start);
+    return rom->located && stride ? GetTableLength(rom, start, stride) : 0;
+  }
+
+
+/* Returns the file an entry of one of the tables in code points to, or -1
+ * for empty entries.
+ */
+int32_t Z64GetTableFile(Z64Rom *rom, int table, uint32_t id)
+  {
+    uint32_t start, stride = GetTableStride(rom, table, &start), w0, w1;
+    if (!rom->located || !stride || id >= GetTableLength(rom, start, stride))
+      return -1;
+    w0 = READ32(&rom->code.data[start + id * stride]);
+    w1 = READ32(&rom->code.data[start + id * stride + 4]);
+    return w0 ? GetFileNumber(rom, w0, w1) : -1;
+  }
+
+
+int Z64GetFile(Z64Rom *rom, Z64File *file, int32_t index)
+  {
+    return rom->located && GetFile(rom, file, index);
+  }
+
+
+void Z64PutFile(Z64Rom *rom, Z64File *file)
+  {
+    PutFile(rom, file);
+  }
+
+
+uint32_t Z64GetFileName(Z64Rom *rom, char buffer[Z64_MAX_NAME + 1], int32_t index)
+  {
+    return GetFileName(rom, buffer, index);
+  }
+
+
+int Z64GetFileTypeOf(Z64Rom *rom, int32_t index)
+  {
+    if (!rom->located || index < 0 || index >= rom->fileTable.size / 16)
+      return ZDATA;
+    return rom->fileTypes[index];
+  }
+
+
+int Z64GetFileType(const uint8_t *data, uint32_t size)
+  {
+    return GetFileType(data, size);
+  }
+
+
+static void Log(Rom *rom, const char *format, ...)
+  {
+    va_list args;
+    if (!rom->log)
+      return;
+    va_start(args, format);
+    vfprintf(rom->log, format, args);
+    va_end(args);
+  }
+
+
+static double GetTime(void)
+  {
+#ifdef _WIN32
+    LARGE_INTEGER counter, frequency;
+    QueryPerformanceCounter(&counter);
+    QueryPerformanceFrequency(&frequency);
+    return (double) counter.QuadPart / frequency.QuadPart;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+#endif
+  }
+
+
+/* user + system time of the whole process */
+static double GetCpuTime(void)
+  {
+#ifdef _WIN32
+    FILETIME creation, exit, kernel, user;
+    if (!GetProcessTimes(GetCurrentProcess(), &creation, &exit, &kernel, &user))
+      return 0;
+    return ((((uint64_t) kernel.dwHighDateTime << 32) | kernel.dwLowDateTime) +
+            (((uint64_t) user.dwHighDateTime << 32) | user.dwLowDateTime)) / 1e7;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+#endif
+  }
+
+
+static void StageStart(StageClock *clock)
+  {
+    clock->wall = GetTime();
+    clock->cpu = GetCpuTime();
+  }
+
+
+/* charges the time since the last lap to stage */
+static void StageLap(Rom *rom, int stage, StageClock *clock)
+  {
+    double wall = GetTime(), cpu = GetCpuTime();
+    rom->stats.wall[stage] += wall - clock->wall;
+    rom->stats.cpu[stage] += cpu - clock->cpu;
+    clock->wall = wall;
+    clock->cpu = cpu;
+  }
+
+
+/* The rom is mapped private (copy-on-write) so that Byteswap(rom) can still fix
+ * the endianness in place; big endian roms are never copied at all and the
+ * uncompressed file views handed out by GetFile(rom) point into the mapping.
+ * Anything that can't be mapped (pipes, empty files) falls back to a heap
+ * copy.
+ */
+static int LoadRom(Rom *rom)
+  {
+#ifdef _WIN32
+    HANDLE file, mapping;
+    LARGE_INTEGER size;
+    file = CreateFileA(rom->filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+                       FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (file != INVALID_HANDLE_VALUE)
+      {
+        if (GetFileSizeEx(file, &size) && size.QuadPart > 0 && size.QuadPart <= 0xFFFFFFFF)
+          {
+            if (mapping = CreateFileMappingA(file, NULL, PAGE_WRITECOPY, 0, 0, NULL))
+              {
+                rom->data = (uint8_t *) MapViewOfFile(mapping, FILE_MAP_COPY, 0, 0, 0);
+                CloseHandle(mapping);
+              }
+            rom->size = (uint32_t) size.QuadPart;
+          }
+        CloseHandle(file);
+      }
+#else
+    struct stat st;
+    void *view;
+    int fd = open(rom->filename, O_RDONLY);
+    if (fd >= 0)
+      {
+        if (!fstat(fd, &st) && S_ISREG(st.st_mode) && st.st_size > 0 &&
+            st.st_size <= 0xFFFFFFFF)
+          {
+            view = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+            if (view != MAP_FAILED)
+              {
+                rom->data = (uint8_t *) view;
+                madvise(view, st.st_size, MADV_WILLNEED);
+              }
+            rom->size = (uint32_t) st.st_size;
+          }
+        close(fd);
+      }
+#endif
+    if (rom->data)
+      {
+        rom->mapped = 1;
+        return 1;
+      }
+    FILE *fp = fopen(rom->filename, "rb");
+    if (!fp)
+      {
+        Log(rom, "ERROR: Failed to open '%s'\n", rom->filename);
+        return 0;
+      }
+    fseek(fp, 0, SEEK_END);
+    rom->size = ftell(fp);
+    rom->data = (uint8_t *) malloc(rom->size);
+    if (!rom->data)
+      {
+        Log(rom, "ERROR:  Failed to allocate memory\n");
+        fclose(fp);
+        return 0;
+      }
+    rewind(fp);
+    fread(rom->data, 1, rom->size, fp);
+    fclose(fp);
+    return 1;
+  }
+
+
+static void UnloadRom(Rom *rom)
+  {
+    if (!rom->data)
+      return;
+    if (rom->mapped)
+#ifdef _WIN32
+      UnmapViewOfFile(rom->data);
+#else
+      munmap(rom->data, rom->size);
+#endif
+    else
+      free(rom->data);
+    rom->data = NULL;
+  }
+
+
+static int Byteswap(Rom *rom)
+  {
+    Log(rom, "byteswapping...              ");
+    switch (READ32(&rom->data[0]))
+      {
+        case 0x80371240:
+          {
+            Log(rom, "ok\n");
+            return Z64_OK;
+          }
+        case 0x40123780:
+          {
+            Log(rom, "little endian");
+            GetByteswapKernel()->swap32(rom->data, rom->size);
+            break;
+          }
+        case 0x37804012:
+          {
+            Log(rom, "middle endian");
+            GetByteswapKernel()->swap16(rom->data, rom->size);
+            break;
+          }
+        default:
+          {
+            Log(rom, "error: unknown endianness\n");
+            return Z64_ERROR_ENDIANNESS;
+          }
+      }
+    Log(rom, " -> big endian\n");
+    return Z64_OK;
+  }
+
+
+#ifndef Z64DUMP_LIBRARY
+/* The original byte-at-a-time loops, kept as the reference the benchmark
+ * compares every kernel against.
+ */
+static void ByteswapReference16(uint8_t *data, uint32_t size)
+  {
+    uint32_t i, c;
+    for (i = 0; i + 3 < size; i += 4)
+      {
+        c = data[i];
+        data[i] = data[i + 1];
+        data[i + 1] = c;
+        c = data[i + 2];
+        data[i + 2] = data[i + 3];
+        data[i + 3] = c;
+      }
+  }
+
+
+static void ByteswapReference32(uint8_t *data, uint32_t size)
+  {
+    uint32_t i, c;
+    for (i = 0; i + 3 < size; i += 4)
+      {
+        c = data[i];
+        data[i] = data[i + 3];
+        data[i + 3] = c;
+        c = data[i + 1];
+        data[i + 1] = data[i + 2];
+        data[i + 2] = c;
+      }
+  }
+#endif
+
+
+static int ScalarSupported(void)
+  {
+    return 1;
+  }
+
+
+static void ScalarSwap16(uint8_t *data, uint32_t size)
+  {
+    uint32_t i, w;
+    for (i = 0; i + 3 < size; i += 4)
+      {
+        memcpy(&w, &data[i], 4);
+        w = ((w & 0x00FF00FF) << 8) | ((w >> 8) & 0x00FF00FF);
+        memcpy(&data[i], &w, 4);
+      }
+  }
+
+
+static void ScalarSwap32(uint8_t *data, uint32_t size)
+  {
+    uint32_t i, w;
+    for (i = 0; i + 3 < size; i += 4)
+      {
+        memcpy(&w, &data[i], 4);
+        w = ((w & 0x00FF00FF) << 8) | ((w >> 8) & 0x00FF00FF);
+        w = (w << 16) | (w >> 16);
+        memcpy(&data[i], &w, 4);
+      }
+  }
+
+
+#ifdef HAVE_X86
+static int CpuSupports(int leaf, int reg, int bit)
+  {
+    uint32_t r[4] = {0};
+#ifdef _MSC_VER
+    int info[4];
+    __cpuid(info, 0);
+    if (info[0] < leaf)
+      return 0;
+    __cpuidex(info, leaf, 0);
+    memcpy(r, info, sizeof(r));
+#else
+    if (!__get_cpuid_count(leaf, 0, &r[0], &r[1], &r[2], &r[3]))
+      return 0;
+#endif
+    return (r[reg] >> bit) & 1;
+  }
+
+
+static int Sse2Supported(void)
+  {
+    return CpuSupports(1, 3, 26);
+  }
+
+
+static int Ssse3Supported(void)
+  {
+    return CpuSupports(1, 2, 9);
+  }
+
+
+static int Avx2Supported(void)
+  {
+    /* the os has to save the ymm state (osxsave + xcr0) as well */
+    if (!CpuSupports(1, 2, 27) || !CpuSupports(1, 2, 28) || !CpuSupports(7, 1, 5))
+      return 0;
+#ifdef _MSC_VER
+    return (_xgetbv(0) & 6) == 6;
+#else
+    uint32_t eax, edx;
+    __asm__ ("xgetbv" : "=a" (eax), "=d" (edx) : "c" (0));
+    return (eax & 6) == 6;
+#endif
+  }
+
+
+TARGET("sse2") static void Sse2Swap16(uint8_t *data, uint32_t size)
+  {
+    uint32_t i;
+    __m128i v;
+    for (i = 0; i + 16 <= size; i += 16)
+      {
+        v = _mm_loadu_si128((__m128i *) &data[i]);
+        v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+        _mm_storeu_si128((__m128i *) &data[i], v);
+      }
+    ScalarSwap16(&data[i], size - i);
+  }
+
+
+TARGET("sse2") static void Sse2Swap32(uint8_t *data, uint32_t size)
+  {
+    uint32_t i;
+    __m128i v;
+    for (i = 0; i + 16 <= size; i += 16)
+      {
+        v = _mm_loadu_si128((__m128i *) &data[i]);
+        v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+        v = _mm_shufflelo_epi16(v, _MM_SHUFFLE(2, 3, 0, 1));
+        v = _mm_shufflehi_epi16(v, _MM_SHUFFLE(2, 3, 0, 1));
+        _mm_storeu_si128((__m128i *) &data[i], v);
+      }
+    ScalarSwap32(&data[i], size - i);
+  }
+
+
+TARGET("ssse3") static void Ssse3Swap(uint8_t *data, uint32_t size, __m128i mask)
+  {
+    uint32_t i;
+    for (i = 0; i + 64 <= size; i += 64)
+      {
+        __m128i v0 = _mm_loadu_si128((__m128i *) &data[i]);
+        __m128i v1 = _mm_loadu_si128((__m128i *) &data[i + 16]);
+        __m128i v2 = _mm_loadu_si128((__m128i *) &data[i + 32]);
+        __m128i v3 = _mm_loadu_si128((__m128i *) &data[i + 48]);
+        _mm_storeu_si128((__m128i *) &data[i], _mm_shuffle_epi8(v0, mask));
+        _mm_storeu_si128((__m128i *) &data[i + 16], _mm_shuffle_epi8(v1, mask));
+        _mm_storeu_si128((__m128i *) &data[i + 32], _mm_shuffle_epi8(v2, mask));
+        _mm_storeu_si128((__m128i *) &data[i + 48], _mm_shuffle_epi8(v3, mask));
+      }
+    for (; i + 16 <= size; i += 16)
+      _mm_storeu_si128((__m128i *) &data[i],
+                       _mm_shuffle_epi8(_mm_loadu_si128((__m128i *) &data[i]), mask));
+  }
+
+
+TARGET("ssse3") static void Ssse3Swap16(uint8_t *data, uint32_t size)
+  {
+    Ssse3Swap(data, size, _mm_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14));
+    ScalarSwap16(&data[size & ~15], size & 15);
+  }
+
+
+TARGET("ssse3") static void Ssse3Swap32(uint8_t *data, uint32_t size)
+  {
+    Ssse3Swap(data, size, _mm_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12));
+    ScalarSwap32(&data[size & ~15], size & 15);
+  }
+
+
+TARGET("avx2") static void Avx2Swap(uint8_t *data, uint32_t size, __m256i mask)
+  {
+    uint32_t i;
+    for (i = 0; i + 128 <= size; i += 128)
+      {
+        __m256i v0 = _mm256_loadu_si256((__m256i *) &data[i]);
+        __m256i v1 = _mm256_loadu_si256((__m256i *) &data[i + 32]);
+        __m256i v2 = _mm256_loadu_si256((__m256i *) &data[i + 64]);
+        __m256i v3 = _mm256_loadu_si256((__m256i *) &data[i + 96]);
+        _mm256_storeu_si256((__m256i *) &data[i], _mm256_shuffle_epi8(v0, mask));
+        _mm256_storeu_si256((__m256i *) &data[i + 32], _mm256_shuffle_epi8(v1, mask));
+        _mm256_storeu_si256((__m256i *) &data[i + 64], _mm256_shuffle_epi8(v2, mask));
+        _mm256_storeu_si256((__m256i *) &data[i + 96], _mm256_shuffle_epi8(v3, mask));
+      }
+    for (; i + 32 <= size; i += 32)
+      _mm256_storeu_si256((__m256i *) &data[i],
+                          _mm256_shuffle_epi8(_mm256_loadu_si256((__m256i *) &data[i]), mask));
+  }
+
+
+TARGET("avx2") static void Avx2Swap16(uint8_t *data, uint32_t size)
+  {
+    Avx2Swap(data, size, _mm256_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14,
+                                          1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14));
+    ScalarSwap16(&data[size & ~31], size & 31);
+  }
+
+
+TARGET("avx2") static void Avx2Swap32(uint8_t *data, uint32_t size)
+  {
+    Avx2Swap(data, size, _mm256_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12,
+                                          3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12));
+    ScalarSwap32(&data[size & ~31], size & 31);
+  }
+#endif
+
+
+/* best first; the scalar kernel is always last so the search can't fail */
+static const ByteswapKernel byteswapKernels[] =
+  {
+#ifdef HAVE_X86
+    {"avx2", Avx2Supported, Avx2Swap16, Avx2Swap32},
+    {"ssse3", Ssse3Supported, Ssse3Swap16, Ssse3Swap32},
+    {"sse2", Sse2Supported, Sse2Swap16, Sse2Swap32},
+#endif
+    {"scalar", ScalarSupported, ScalarSwap16, ScalarSwap32}
+  };
+
+
+static const ByteswapKernel *GetByteswapKernel(void)
+  {
+    static const ByteswapKernel *kernel = NULL;
+    int i;
+    if (!kernel)
+      {
+        for (i = 0; !byteswapKernels[i].supported(); i++);
+        kernel = &byteswapKernels[i];
+      }
+    return kernel;
+  }
+
+
+static void CheckRomType(Rom *rom)
+  {
+    Log(rom, "checking rom type...         ");
+    rom->steSize = 0x14;
+    if (!memcmp(&rom->data[0x20], "ZELDA MAJORA'S MASK ", 20))
+      {
+        Log(rom, "Majora's Mask\n");
+        rom->isMM = 1;
+        rom->steSize -= 4;
+      }
+    else
+      Log(rom, "Ocarina of Time\n");
+  }
+
+
+static int LocateFileTable(Rom *rom)
+  {
+    Log(rom, "locating file table...       ");
+    ScanRom(rom);
+    if (!rom->fileTable.start || rom->fileTable.start + rom->fileTable.size > rom->size)
+      {
+        Log(rom, "error: not found\n");
+        return Z64_ERROR_FILE_TABLE;
+      }
+    Log(rom, "found [%08X, %i files]\n", rom->fileTable.start, rom->fileTable.size / 16);
+    if (BuildVromIndex(rom) || !CacheInit(rom))
+      {
+        Log(rom, "ERROR:  Failed to allocate memory\n");
+        return Z64_ERROR_MEMORY;
+      }
+    return Z64_OK;
+  }
+
+
+/* Verifies the candidate words flagged in the 16 byte block at i: a lane whose
+ * word reads "make" may start the file name table ("makerom\0", 4 byte
+ * aligned) and lane 1 reading 0x1060 may be the end of the makerom entry
+ * that starts dmadata (16 byte aligned, followed by the boot entry).  Returns
+ * 1 once every signature has been found.
+ */
+static int CheckSignatures(Rom *rom, uint32_t i, uint32_t lanes)
+  {
+    uint32_t k;
+    FileTableEntry fte;
+    if ((lanes & 2) && !rom->fileTable.start && i + 48 <= rom->size)
+      {
+        READFTE(&fte, &rom->data[i]);
+        if (!fte.virtual.start && fte.virtual.end == 0x00001060 &&
+            !fte.physical.start && !fte.physical.end)
+          {
+            READFTE(&fte, &rom->data[i + 16]);
+            if (fte.virtual.start == 0x00001060 && fte.virtual.end &&
+                fte.physical.start == 0x00001060 && !fte.physical.end)
+              {
+                rom->fileTable.start = i;
+                READFTE(&fte, &rom->data[i + 32]);
+                rom->fileTable.size = fte.virtual.end - fte.virtual.start;
+              }
+          }
+      }
+    for (k = 0; k < 4 && !rom->fileNameTable; k++)
+      {
+        if ((lanes & (1 << k)) && i + k * 4 + 8 <= rom->size &&
+            READ32(&rom->data[i + k * 4]) == 0x6D616B65 &&
+            READ32(&rom->data[i + k * 4 + 4]) == 0x726F6D00)
+          rom->fileNameTable = i + k * 4;
+      }
+    return rom->fileTable.start && rom->fileNameTable;
+  }
+
+
+#ifdef HAVE_X86
+TARGET("sse2") static uint32_t ScanRomSse2(Rom *rom)
+  {
+    uint32_t i, lanes, make, dma;
+    __m128i v, makeVec, dmaVec;
+    memcpy(&make, "make", 4);
+    memcpy(&dma, "\0\0\x10\x60", 4);
+    makeVec = _mm_set1_epi32(make);
+    dmaVec = _mm_setr_epi32(make, dma, make, make);
+    for (i = 0; i + 16 <= rom->size; i += 16)
+      {
+        v = _mm_loadu_si128((__m128i *) &rom->data[i]);
+        v = _mm_or_si128(_mm_cmpeq_epi32(v, makeVec), _mm_cmpeq_epi32(v, dmaVec));
+        if (lanes = _mm_movemask_ps(_mm_castsi128_ps(v)))
+          {
+            if (CheckSignatures(rom, i, lanes))
+              break;
+          }
+      }
+    return i;
+  }
+#endif
+
+
+/* Finds the file table and the file name table in one sweep over the rom
+ * instead of one full pass each.  The first word of every lane is compared
+ * against both signatures at once and only the hits are checked in full.
+ */
+static void ScanRom(Rom *rom)
+  {
+    uint32_t i = 0, k, lanes, w;
+    rom->fileTable.start = rom->fileNameTable = 0;
+#ifdef HAVE_X86
+    if (Sse2Supported())
+      i = ScanRomSse2(rom);
+#endif
+    for (; i < rom->size && !(rom->fileTable.start && rom->fileNameTable); i += 16)
+      {
+        lanes = 0;
+        for (k = 0; k < 4 && i + k * 4 + 4 <= rom->size; k++)
+          {
+            w = READ32(&rom->data[i + k * 4]);
+            if (w == 0x6D616B65 || (k == 1 && w == 0x00001060))
+              lanes |= 1 << k;
+          }
+        if (lanes)
+          CheckSignatures(rom, i, lanes);
+      }
+    rom->stats.scanned += i < rom->size ? i : rom->size;
+  }
+
+
+static int CompareVromIndex(const void *a, const void *b)
+  {
+    const VromIndex *x = (const VromIndex *) a, *y = (const VromIndex *) b;
+    if (x->start != y->start)
+      return x->start < y->start ? -1 : 1;
+    return x->index < y->index ? -1 : x->index > y->index;
+  }
+
+
+/* GetFileNumber(rom) is hit for every table entry and repeatedly by the
+ * backwards walks in the Locate*Table() functions, so the file table is
+ * sorted by virtual start once here and searched instead of scanned.  Ties
+ * stay in file table order so lookups still return the first match.
+ */
+static int BuildVromIndex(Rom *rom)
+  {
+    uint32_t i, count = rom->fileTable.size / 16;
+    FileTableEntry fte;
+    rom->vromIndex = (VromIndex *) malloc((count ? count : 1) * sizeof(VromIndex));
+    if (!rom->vromIndex)
+      return Z64_ERROR_MEMORY;
+    for (i = 0; i < count; i++)
+      {
+        READFTE(&fte, &rom->data[rom->fileTable.start + i * 16]);
+        rom->vromIndex[i].start = fte.virtual.start;
+        rom->vromIndex[i].end = fte.virtual.end;
+        rom->vromIndex[i].index = i;
+      }
+    qsort(rom->vromIndex, count, sizeof(VromIndex), CompareVromIndex);
+    return Z64_OK;
+  }
+
+
+/* Every file is classified up front, in parallel, into rom->fileTypes; the
+ * code file is the first one with the codesig and the samples the code
+ * tables are looked for with are the first three of each type in the file
+ * table, wherever they are in the rom.  Beyond that the types only go into
+ * the index file and out through Z64GetFileTypeOf(); extraction goes by the
+ * tables, which say what a file is even when its contents don't.
+ */
+static int LocateCodeFile(Rom *rom)
+  {
+    Log(rom, "locating code file...        ");
+    uint32_t i, srcSize, count = rom->fileTable.size / 16;
+    FileTableEntry fte;
+    if (!(rom->fileTypes = (uint8_t *) calloc(count ? count : 1, 1)))
+      {
+        Log(rom, "ERROR:  Failed to allocate memory\n");
+        return Z64_ERROR_MEMORY;
+      }
+    ParallelFor(count, ClassifyFile, rom);
+    for (i = 0; i < count; i++)
+      {
+        switch (rom->fileTypes[i])
+          {
+            case ZASM:
+              {
+                if (!rom->code.virtual.start && !GetFile(rom, &rom->code, i))
+                  rom->code.virtual.start = 0;
+                break;
+              }
+            case ZACTOR:
+              {
+                if (rom->ac < 3 && FindFile(rom, &fte, i, &srcSize))
+                  memcpy(&rom->actor[rom->ac++], &fte, 16);
+                break;
+              }
+            case ZOBJ:
+              {
+                if (rom->oc < 3 && FindFile(rom, &fte, i, &srcSize))
+                  memcpy(&rom->object[rom->oc++], &fte, 16);
+                break;
+              }
+            case ZSCENE:
+              {
+                if (rom->sc < 3 && FindFile(rom, &fte, i, &srcSize))
+                  memcpy(&rom->scene[rom->sc++], &fte, 16);
+                break;
+              }
+          }
+      }
+    if (!rom->code.virtual.start)
+      {
+        Log(rom, "error: not found\n");
+        return Z64_ERROR_CODE_FILE;
+      }
+    Log(rom, "found [%08X - %08X]\n", rom->code.virtual.start, rom->code.virtual.end);
+    return Z64_OK;
+  }
+
+
+/* Scenes and maps are known from the first commands, so only those are
+ * decoded for them; everything else needs the whole file for the trailer
+ * checks in GetFileType().
+ */
+static void ClassifyFile(void *arg, uint32_t index)
+  {
+    Rom *rom = (Rom *) arg;
+    FileTableEntry fte;
+    int type = ZDATA;
+    if (GetFilePrefix(rom, &fte, index, SCENE_HEADER))
+      {
+        if ((type = GetHeaderType(fte.data, fte.size)) == ZDATA && ExtendFile(rom, &fte, 0xFFFFFFFF))
+          type = GetFileType(fte.data, fte.size);
+        PutFile(rom, &fte);
+      }
+    rom->fileTypes[index] = type;
+  }
+
+
+static int LocateFileNameTable(Rom *rom)
+  {
+    Log(rom, "locating file name table...  ");
+    /* already found by the ScanRom(rom) in LocateFileTable(rom) */
+    if (!rom->fileNameTable)
+      {
+        Log(rom, "N/A\n");
+        return Z64_OK;
+      }
+    Log(rom, "found [%08X]\n", rom->fileNameTable);
+    if (BuildFileNameIndex(rom))
+      {
+        Log(rom, "ERROR:  Failed to allocate memory\n");
+        return Z64_ERROR_MEMORY;
+      }
+    return Z64_OK;
+  }
+
+
+/* The name table is a run of NUL separated strings (padded with extra NULs)
+ * in file table order.  It's split up once here so GetFileName(rom) doesn't have
+ * to walk it from the start for every file.
+ */
+static int BuildFileNameIndex(Rom *rom)
+  {
+    uint32_t i, j = rom->fileNameTable, count = rom->fileTable.size / 16;
+    rom->fileNames = (FileName *) malloc((count ? count : 1) * sizeof(FileName));
+    if (!rom->fileNames)
+      return Z64_ERROR_MEMORY;
+    for (i = 0; i < count; i++)
+      {
+        for (; j < rom->size && !rom->data[j]; j++);
+        rom->fileNames[i].offset = j;
+        for (; j < rom->size && rom->data[j]; j++);
+        rom->fileNames[i].length = j - rom->fileNames[i].offset;
+      }
+    return Z64_OK;
+  }
+
+
+/* The scene, object and actor tables are found by looking for the file
+ * table ranges of the first three files of each type that LocateCodeFile(rom)
+ * came across.  Rather than a pass over code per table, every sample is put in
+ * a small hash keyed on its virtual start and all tables are matched in one
+ * pass; a sample's physical.start is reused to hold its offset in rom->code.  Like
+ * the old per-table scans, a table skips the rest of an entry after a match.
+ */
+static void ScanCodeFile(Rom *rom)
+  {
+    struct
+      {
+        uint32_t start, end;
+        uint8_t table, sample;
+      } slot[32] = {{0}};
+    const CodeTable codeTables[] =
+      {
+        {rom->scene, &rom->sc},
+        {rom->object, &rom->oc},
+        {rom->actor, &rom->ac}
+      };
+    uint8_t used[32] = {0};
+    uint32_t i, t, k, h, w0, w1, skip[sizeof(codeTables) / sizeof(codeTables[0])] = {0};
+    int remaining = 0;
+    for (t = 0; t < sizeof(codeTables) / sizeof(codeTables[0]); t++)
+      {
+        if (*codeTables[t].count < 3)
+          continue;
+        for (k = 0; k < 3; k++)
+          {
+            codeTables[t].sample[k].physical.start = 0;
+            for (h = (codeTables[t].sample[k].virtual.start * 0x9E3779B1) >> 27; used[h]; h = (h + 1) & 31);
+            used[h] = 1;
+            slot[h].start = codeTables[t].sample[k].virtual.start;
+            slot[h].end = codeTables[t].sample[k].virtual.end;
+            slot[h].table = t;
+            slot[h].sample = k;
+          }
+        remaining |= 1 << t;
+      }
+    for (i = 0; remaining && i + 8 <= rom->code.size; i += 4)
+      {
+        w0 = READ32(&rom->code.data[i]);
+        for (h = (w0 * 0x9E3779B1) >> 27; used[h]; h = (h + 1) & 31)
+          {
+            t = slot[h].table;
+            if (slot[h].start != w0 || i < skip[t] || !(remaining & (1 << t)))
+              continue;
+            w1 = READ32(&rom->code.data[i + 4]);
+            if (slot[h].end != w1)
+              continue;
+            codeTables[t].sample[slot[h].sample].physical.start = i;
+            skip[t] = i + rom->steSize;
+            if (codeTables[t].sample[0].physical.start && codeTables[t].sample[1].physical.start &&
+                codeTables[t].sample[2].physical.start)
+              remaining &= ~(1 << t);
+          }
+      }
+    rom->stats.scanned += i;
+  }
+
+
+static int LocateSceneTable(Rom *rom)
+  {
+    Log(rom, "locating scene table...      ");
+    uint32_t i, w0, w1;
+    if (rom->sc < 3)
+      {
+        Log(rom, "error: not found\n");
+        return Z64_ERROR_SCENE_TABLE;
+      }
+    if (!rom->scene[0].physical.start && !rom->scene[1].physical.start && !rom->scene[2].physical.start)
+      {
+        Log(rom, "error: not found\n");
+        return Z64_ERROR_SCENE_TABLE;
+      }
+    rom->scene[0].physical.end = rom->scene[0].physical.start < rom->scene[1].physical.start ?
+                            rom->scene[0].physical.start : rom->scene[1].physical.start;
+    rom->scene[0].physical.end = rom->scene[0].physical.end < rom->scene[2].physical.start ?
+                            rom->scene[0].physical.end : rom->scene[2].physical.start;
+    rom->scene[2].physical.end = rom->scene[0].physical.start > rom->scene[1].physical.start ?
+                            rom->scene[0].physical.start : rom->scene[1].physical.start;
+    rom->scene[2].physical.end = rom->scene[2].physical.end > rom->scene[2].physical.start ?
+                            rom->scene[2].physical.end : rom->scene[2].physical.start;
+    if (rom->scene[0].physical.start > rom->scene[0].physical.end &&
+        rom->scene[0].physical.start < rom->scene[2].physical.end)
+      rom->scene[1].physical.end = rom->scene[0].physical.start;
+    else if (rom->scene[1].physical.start > rom->scene[0].physical.end &&
+             rom->scene[1].physical.start < rom->scene[2].physical.end)
+      rom->scene[1].physical.end = rom->scene[1].physical.start;
+    else if (rom->scene[2].physical.start > rom->scene[0].physical.end &&
+             rom->scene[2].physical.start < rom->scene[2].physical.end)
+      rom->scene[1].physical.end = rom->scene[2].physical.start;
+    if (!rom->scene[0].physical.end)
+      rom->scene[0].physical.end = rom->scene[1].physical.end;
+    if (!rom->scene[0].physical.end)
+      rom->scene[0].physical.end = rom->scene[2].physical.end;
+    if (!rom->scene[0].physical.end ||
+        ((rom->scene[1].physical.end - rom->scene[0].physical.end) % rom->steSize) ||
+        ((rom->scene[2].physical.end - rom->scene[1].physical.end) % rom->steSize))
+      {
+        Log(rom, "error: not found\n");
+        return Z64_ERROR_SCENE_TABLE;
+      }
+    i = rom->scene[0].physical.end;
+    while (i)
+      {
+        w0 = READ32(&rom->code.data[i]);
+        w1 = READ32(&rom->code.data[i + 4]);
+        if (!w0 || GetFileNumber(rom, w0, w1) >= 0)
+          i -= rom->steSize;
+        else
+          break;
+      }
+    rom->sceneTable.start = i + rom->steSize;
+    Log(rom, "found [%08X]\n", rom->code.virtual.start + rom->sceneTable.start);
+    return Z64_OK;
+  }
+
+
+static int LocateObjectTable(Rom *rom)
+  {
+    Log(rom, "locating object table...     ");
+    uint32_t i, w0;
+    if (rom->oc < 3)
+      {
+        Log(rom, "error: not found\n");
+        return Z64_ERROR_OBJECT_TABLE;
+      }
+    if (!rom->object[0].physical.start)
+      rom->object[0] = rom->object[1];
+    if (!rom->object[0].physical.start)
+      rom->object[0] = rom->object[2];
+    if (!rom->object[0].physical.start)
+      {
+        Log(rom, "error: not found\n");
+        return Z64_ERROR_OBJECT_TABLE;
+      }
+    i = rom->object[0].physical.start;
+    while (i)
+      {
+        w0 = READ32(&rom->code.data[i]);
+        if (!w0 || GetFileNumber(rom, w0, 0) >= 0)
+          i -= 8;
+        else
+          break;
+      }
+    rom->objectTable.start = i + 8;
+    Log(rom, "found [%08X]\n", rom->code.virtual.start + rom->objectTable.start);
+    return Z64_OK;
+  }
+
+
+static int LocateActorTable(Rom *rom)
+  {
+    Log(rom, "locating actor table...      ");
+    uint32_t i, w0;
+    if (rom->ac < 3)
+      {
+        Log(rom, "error: not found\n");
+        return Z64_ERROR_ACTOR_TABLE;
+      }
+    if (!rom->actor[0].physical.start)
+      rom->actor[0] = rom->actor[1];
+    if (!rom->actor[0].physical.start)
+      rom->actor[0] = rom->actor[2];
+    if (!rom->actor[0].physical.start)
+      {
+        Log(rom, "error: not found\n");
+        return Z64_ERROR_ACTOR_TABLE;
+      }
+    i = rom->actor[0].physical.start;
+    while (i)
+      {
+        w0 = READ32(&rom->code.data[i]);
+        if (!w0 || GetFileNumber(rom, w0, 0) >= 0)
+          i -= 32;
+        else
+          break;
+      }
+    rom->actorTable.start = i + 32;
+    Log(rom, "found [%08X]\n", rom->code.virtual.start + rom->actorTable.start);
+    return Z64_OK;
+  }
+
+
+/* The index is a small text file with what Z64Locate() worked out about a
+ * rom, so the next run on the same rom can skip the searches.  It's keyed
+ * by a hash of the header and the file table, and what it says is checked
+ * against the rom before it's used: the code file still has to end in the
+ * codesig and every table still has to start with a file.
+ */
+static uint64_t IndexHash(Rom *rom)
+  {
+    return HashData(rom->data, 0x40) ^
+           (HashData(&rom->data[rom->fileTable.start], rom->fileTable.size) * 0x9E3779B185EBCA87ULL);
+  }
+
+
+/* undoes a partly loaded index so the searches start from scratch */
+static void ForgetIndex(Rom *rom)
+  {
+    PutFile(rom, &rom->code);
+    memset(&rom->code, 0, sizeof(FileTableEntry));
+    CacheFree(rom);
+    rom->cache.lru = rom->cache.mru = NULL;
+    rom->cache.bytes = 0;
+    free(rom->fileTypes);
+    free(rom->vromIndex);
+    free(rom->fileNames);
+    rom->fileTypes = NULL;
+    rom->vromIndex = NULL;
+    rom->fileNames = NULL;
+    rom->fileTable.start = rom->fileTable.size = rom->fileNameTable = 0;
+    rom->sceneTable.start = rom->objectTable.start = rom->actorTable.start = 0;
+  }
+
+
+/* a table still starts at start if the entry before it isn't a file, the
+ * same place LocateSceneTable(rom) and the others would stop walking back to
+ */
+static int IndexTable(Rom *rom, uint32_t start, uint32_t stride)
+  {
+    uint32_t w0;
+    if (start < stride || start > rom->code.size || !GetTableLength(rom, start, stride))
+      return 0;
+    w0 = READ32(&rom->code.data[start - stride]);
+    return w0 && GetFileNumber(rom, w0, 0) < 0;
+  }
+
+
+static int ReadIndex(Rom *rom, FILE *fp)
+  {
+    char line[256];
+    unsigned long long hash;
+    unsigned int isMM, steSize, start, size, names, scenes, objects, actors;
+    uint32_t i, count;
+    int code, c;
+    if (!fgets(line, sizeof(line), fp) || strcmp(line, INDEX_HEADER) ||
+        fscanf(fp, "hash %llX rom %u %u files %X %X %X code %i tables %X %X %X types ", &hash,
+               &isMM, &steSize, &start, &size, &names, &code, &scenes, &objects, &actors) != 10)
+      return 0;
+    if (isMM != rom->isMM || steSize != rom->steSize || size % 16 || size < 48 ||
+        start > rom->size || size > rom->size - start)
+      return 0;
+    rom->fileTable.start = start;
+    rom->fileTable.size = size;
+    count = size / 16;
+    if (hash != IndexHash(rom) || code < 0 || (uint32_t) code >= count)
+      return 0;
+    if (BuildVromIndex(rom) || !CacheInit(rom) || !(rom->fileTypes = (uint8_t *) malloc(count)))
+      return 0;
+    for (i = 0; i < count && (c = fgetc(fp)) != EOF; i++)
+      {
+        if (c >= '0' && c <= '9')
+          rom->fileTypes[i] = c - '0';
+        else if (c >= 'A' && c <= 'F')
+          rom->fileTypes[i] = c - 'A' + 10;
+        else
+          return 0;
+      }
+    if (i < count)
+      return 0;
+    if (!GetFile(rom, &rom->code, code))
+      {
+        /* already put back */
+        memset(&rom->code, 0, sizeof(FileTableEntry));
+        return 0;
+      }
+    if (GetFileType(rom->code.data, rom->code.size) != ZASM)
+      return 0;
+    rom->sceneTable.start = scenes;
+    rom->objectTable.start = objects;
+    rom->actorTable.start = actors;
+    if (!IndexTable(rom, scenes, steSize) || !IndexTable(rom, objects, 8) ||
+        !IndexTable(rom, actors, 32))
+      return 0;
+    rom->fileNameTable = names;
+    if (names && (names > rom->size - 8 || memcmp(&rom->data[names], "makerom", 8) ||
+                  BuildFileNameIndex(rom)))
+      return 0;
+    return 1;
+  }
+
+
+static int LoadIndex(Rom *rom)
+  {
+    Log(rom, "loading index...             ");
+    FILE *fp;
+    int ok;
+    if (!(fp = fopen(rom->indexFile, "r")))
+      {
+        Log(rom, "N/A\n");
+        return 0;
+      }
+    ok = ReadIndex(rom, fp);
+    fclose(fp);
+    if (!ok)
+      {
+        ForgetIndex(rom);
+        Log(rom, "out of date\n");
+        return 0;
+      }
+    Log(rom, "found [%u files, code %08X, tables %08X %08X %08X]\n", rom->fileTable.size / 16,
+        rom->code.virtual.start, rom->code.virtual.start + rom->sceneTable.start,
+        rom->code.virtual.start + rom->objectTable.start,
+        rom->code.virtual.start + rom->actorTable.start);
+    return 1;
+  }
+
+
+/* Written next to the old one and renamed over it; a rom the index can't
+ * be written for just gets searched again next time.
+ */
+static void SaveIndex(Rom *rom)
+  {
+    static const char digits[] = "0123456789ABCDEF";
+    uint32_t i, count = rom->fileTable.size / 16;
+    char temp[1040];
+    FILE *fp;
+    int ok;
+    if (strlen(rom->indexFile) > 1024)
+      return;
+    sprintf(temp, "%s.new", rom->indexFile);
+    if (!(fp = fopen(temp, "w")))
+      return;
+    fputs(INDEX_HEADER, fp);
+    fprintf(fp, "hash %016llX\nrom %u %u\nfiles %08X %08X %08X\ncode %i\ntables %08X %08X %08X\ntypes ",
+            (unsigned long long) IndexHash(rom), rom->isMM, rom->steSize, rom->fileTable.start,
+            rom->fileTable.size, rom->fileNameTable, rom->code.index, rom->sceneTable.start,
+            rom->objectTable.start, rom->actorTable.start);
+    for (i = 0; i < count; i++)
+      fputc(digits[rom->fileTypes[i] & 15], fp);
+    fputc('\n', fp);
+    ok = !ferror(fp);
+    ok = !fclose(fp) && ok;
+#ifdef _WIN32
+    if (ok)
+      remove(rom->indexFile);
+#endif
+    if (!ok || rename(temp, rom->indexFile))
+      remove(temp);
+  }
+
+
+/* Counts the entries of a table in code up to the first one that isn't empty
+ * and doesn't name a file.
+ */
+static uint32_t GetTableLength(Rom *rom, uint32_t start, uint32_t stride)
+  {
+    uint32_t i, w0, w1;
+    for (i = start; i + stride <= rom->code.size; i += stride)
+      {
+        w0 = READ32(&rom->code.data[i]);
+        w1 = READ32(&rom->code.data[i + 4]);
+        if (w0 && GetFileNumber(rom, w0, w1) < 0)
+          break;
+      }
+    return (i - start) / stride;
+  }
+
+
+/* The filters from the extract options.  Entries outside the id range and
+ * files whose names don't match are dropped before anything is decompressed;
+ * only the actor group needs the overlay itself.
+ */
+static int Extracts(Rom *rom, uint32_t what)
+  {
+    return !rom->options.extract || (rom->options.extract & what);
+  }
+
+
+static int IdSelected(Rom *rom, uint32_t id)
+  {
+    return !rom->options.idCount ||
+           (id >= rom->options.firstId && id - rom->options.firstId < rom->options.idCount);
+  }
+
+
+/* * matches any run of characters, ? any single one */
+static int MatchGlob(const char *pattern, const char *name)
+  {
+    const char *star = NULL, *resume = NULL;
+    while (*name)
+      {
+        if (*pattern == '*')
+          {
+            star = pattern++;
+            resume = name;
+          }
+        else if (*pattern == '?' || *pattern == *name)
+          {
+            pattern++;
+            name++;
+          }
+        else if (star)
+          {
+            pattern = star + 1;
+            name = ++resume;
+          }
+        else
+          return 0;
+      }
+    while (*pattern == '*')
+      pattern++;
+    return !*pattern;
+  }
+
+
+static int NameSelected(Rom *rom, int32_t index)
+  {
+    char name[MAX_NAME + 1];
+    if (!rom->options.name)
+      return 1;
+    GetFileName(rom, name, index);
+    return MatchGlob(rom->options.name, name);
+  }
+
+
+static int Filtered(const Z64Options *options)
+  {
+    return options->extract || options->idCount || options->categories || options->name;
+  }
+
+
+/* The extract phases size their table first and then hand every entry to
+ * ParallelFor(); paths only depend on the entry, and the totals are summed
+ * from the per-entry results afterwards so they don't depend on the order
+ * the entries finished in.
+ */
+static int ExtractScenesAndMaps(Rom *rom)
+  {
+    Log(rom, "extracting scenes and maps...");
+    uint32_t i, count, totalScenes = 0, totalMaps = 0;
+    ExtractResult *result;
+    count = GetTableLength(rom, rom->sceneTable.start, rom->steSize);
+    if (!(result = (ExtractResult *) calloc(count ? count : 1, sizeof(ExtractResult))))
+      {
+        Log(rom, "ERROR:  Failed to allocate memory\n");
+        return Z64_ERROR_MEMORY;
+      }
+    rom->results = result;
+    ParallelFor(count, ExtractScene, rom);
+    WriterFlush(rom);
+    for (i = 0; i < count; i++)
+      {
+        totalScenes += result[i].files;
+        totalMaps += result[i].maps;
+      }
+    free(result);
+    Log(rom, "ok    [%i/%i scenes, %i maps]\n", totalScenes, count, totalMaps);
+    return Z64_OK;
+  }
+
+
+static void ExtractScene(void *arg, uint32_t id)
+  {
+    Rom *rom = (Rom *) arg;
+    ExtractResult *result = &rom->results[id];
+    uint32_t i = rom->sceneTable.start + id * rom->steSize, j, k, w0, w1, mapCount, mapList;
+    int32_t fileNum;
+    uint64_t source;
+    int scene, maps = Extracts(rom, Z64_EXTRACT_MAPS);
+    char filePath[512];
+    FileTableEntry fte, map;
+    w0 = READ32(&rom->code.data[i]);
+    w1 = READ32(&rom->code.data[i + 4]);
+    if (!w0 || !IdSelected(rom, id) || (fileNum = GetFileNumber(rom, w0, w1)) < 0)
+      return;
+    scene = Extracts(rom, Z64_EXTRACT_SCENES) && NameSelected(rom, fileNum);
+    if ((!scene && !maps) || !GetFilePrefix(rom, &fte, fileNum, SCENE_HEADER))
+      return;
+    for (j = 0; maps && NextMapList(rom, &fte, &j, &mapCount, &mapList);)
+      {
+        if (!rom->options.name)
+          result->maps += mapCount;
+        for (k = 0; k < mapCount && mapList + k * 8 + 8 <= fte.size; k++)
+          {
+            w0 = READ32(&fte.data[mapList + k * 8]);
+            fileNum = GetFileNumber(rom, w0, 0);
+            if (rom->options.name && (fileNum < 0 || !NameSelected(rom, fileNum)))
+              continue;
+            result->maps += rom->options.name != NULL;
+            if (fileNum >= 0 && !Unchanged(rom, ZMAP, id, k, fileNum, 0, &source) &&
+                GetFile(rom, &map, fileNum))
+              {
+                MapPath(rom, filePath, id, fileNum);
+                WriteFile(rom, filePath, ZMAP, id, k, &map, source, NULL);
+              }
+          }
+      }
+    /* the scene itself goes last, its data was needed for the map list */
+    if (!scene)
+      {
+        PutFile(rom, &fte);
+        return;
+      }
+    if (Unchanged(rom, ZSCENE, id, 0, fte.index, 0, &source))
+      {
+        PutFile(rom, &fte);
+        result->files++;
+        return;
+      }
+    if (!ExtendFile(rom, &fte, 0xFFFFFFFF))
+      {
+        PutFile(rom, &fte);
+        return;
+      }
+    ScenePath(rom, filePath, id, fte.index);
+    WriteFile(rom, filePath, ZSCENE, id, 0, &fte, source, &result->files);
+  }
+
+
+/* Walks the header commands of a scene from *offset up to the end marker,
+ * stopping after each map list command with its map count and the offset
+ * of the list in the scene.  Returns 0 once there are no more.  The scene
+ * can be a prefix from GetFilePrefix(rom); it's decoded as far as the
+ * commands and the list go.
+ */
+static int NextMapList(Rom *rom, FileTableEntry *scene, uint32_t *offset, uint32_t *count,
+                       uint32_t *list)
+  {
+    uint32_t w0;
+    for (;; *offset += 8)
+      {
+        if (*offset + 8 > scene->size &&
+            (!ExtendFile(rom, scene, *offset + 8) || *offset + 8 > scene->size))
+          break;
+        w0 = READ32(&scene->data[*offset]);
+        if ((w0 & 0xFF000000) == 0x04000000)
+          {
+            *count = (w0 >> 16) & 0xFF;
+            *list = READ32(&scene->data[*offset + 4]) & 0x00FFFFFF;
+            *offset += 8;
+            ExtendFile(rom, scene, *list + *count * 8);
+            return 1;
+          }
+        if (w0 == 0x14000000)
+          break;
+      }
+    return 0;
+  }
+
+
+static int ExtractActors(Rom *rom)
+  {
+    Log(rom, "extracting actors...         ");
+    uint32_t i, count, totalActors = 0;
+    ExtractResult *result;
+    count = GetTableLength(rom, rom->actorTable.start, 32);
+    if (!(result = (ExtractResult *) calloc(count ? count : 1, sizeof(ExtractResult))))
+      {
+        Log(rom, "ERROR:  Failed to allocate memory\n");
+        return Z64_ERROR_MEMORY;
+      }
+    rom->results = result;
+    ParallelFor(count, ExtractActor, rom);
+    WriterFlush(rom);
+    for (i = 0; i < count; i++)
+      totalActors += result[i].files;
+    free(result);
+    Log(rom, "ok    [%i/%i actors]\n", totalActors, count);
+    return Z64_OK;
+  }
+
+
+static void ExtractActor(void *arg, uint32_t id)
+  {
+    Rom *rom = (Rom *) arg;
+    ExtractResult *result = &rom->results[id];
+    uint32_t i = rom->actorTable.start + id * 32, start, end, info, group, objectId;
+    int32_t fileNum;
+    uint64_t source;
+    char filePath[512];
+    FileTableEntry fte;
+    start = READ32(&rom->code.data[i]);
+    end = READ32(&rom->code.data[i + 4]);
+    info = READ32(&rom->code.data[i + 20]) - READ32(&rom->code.data[i + 8]);
+    if (!start || !IdSelected(rom, id) || (fileNum = GetFileNumber(rom, start, end)) < 0 ||
+        !NameSelected(rom, fileNum))
+      return;
+    /* the path depends on the overlay's data, so it comes from the manifest */
+    if (!rom->options.categories && Unchanged(rom, ZACTOR, id, 0, fileNum, info, &source))
+      {
+        result->files++;
+        return;
+      }
+    if (!GetFilePrefix(rom, &fte, fileNum, info + 10))
+      return;
+    group = objectId = 0;
+    if (info < fte.size && fte.size - info >= 10)
+      {
+        group = fte.data[info + 2];
+        objectId = (fte.data[info + 8] << 8) | fte.data[info + 9];
+      }
+    /* the group is only known now, so a category filter checks the manifest late */
+    if (rom->options.categories)
+      {
+        if (group > 31 || !(rom->options.categories & (1u << group)))
+          {
+            PutFile(rom, &fte);
+            return;
+          }
+        if (Unchanged(rom, ZACTOR, id, 0, fileNum, info, &source))
+          {
+            PutFile(rom, &fte);
+            result->files++;
+            return;
+          }
+      }
+    if (!ExtendFile(rom, &fte, 0xFFFFFFFF))
+      {
+        PutFile(rom, &fte);
+        return;
+      }
+    ActorPath(rom, filePath, id, group, objectId, fileNum);
+    WriteFile(rom, filePath, ZACTOR, id, objectId, &fte, source, &result->files);
+  }
+
+
+static int ExtractObjects(Rom *rom)
+  {
+    Log(rom, "extracting objects...        ");
+    uint32_t i, count, totalObjects = 0;
+    ExtractResult *result;
+    count = GetTableLength(rom, rom->objectTable.start, 8);
+    if (!(result = (ExtractResult *) calloc(count ? count : 1, sizeof(ExtractResult))))
+      {
+        Log(rom, "ERROR:  Failed to allocate memory\n");
+        return Z64_ERROR_MEMORY;
+      }
+    rom->results = result;
+    ParallelFor(count, ExtractObject, rom);
+    WriterFlush(rom);
+    for (i = 0; i < count; i++)
+      totalObjects += result[i].files;
+    free(result);
+    Log(rom, "ok    [%i/%i objects]\n", totalObjects, count);
+    return Z64_OK;
+  }
+
+
+static void ExtractObject(void *arg, uint32_t id)
+  {
+    Rom *rom = (Rom *) arg;
+    ExtractResult *result = &rom->results[id];
+    uint32_t i = rom->objectTable.start + id * 8, start, end;
+    int32_t fileNum;
+    uint64_t source;
+    char filePath[512];
+    FileTableEntry fte;
+    start = READ32(&rom->code.data[i]);
+    end = READ32(&rom->code.data[i + 4]);
+    if (!start || !IdSelected(rom, id) || (fileNum = GetFileNumber(rom, start, end)) < 0 ||
+        !NameSelected(rom, fileNum))
+      return;
+    if (Unchanged(rom, ZOBJ, id, 0, fileNum, 0, &source))
+      {
+        result->files++;
+        return;
+      }
+    if (!GetFile(rom, &fte, fileNum))
+      return;
+    ObjectPath(rom, filePath, id, fileNum);
+    WriteFile(rom, filePath, ZOBJ, id, 0, &fte, source, &result->files);
+  }
+
+
+/* Where Z64Extract(rom) puts each kind of file; Z64Rebuild(rom) looks for
+ * them in the same places.  path needs room for 512 bytes.
+ */
+static void ScenePath(Rom *rom, char *path, uint32_t id, int32_t fileNum)
+  {
+    uint32_t n = sprintf(path, "data/scenes/%03i/", id);
+    n += GetFileName(rom, &path[n], fileNum);
+    memcpy(&path[n], ".zscene", 8);
+  }
+
+
+static void MapPath(Rom *rom, char *path, uint32_t sceneId, int32_t fileNum)
+  {
+    uint32_t n = sprintf(path, "data/scenes/%03i/maps/", sceneId);
+    n += GetFileName(rom, &path[n], fileNum);
+    memcpy(&path[n], ".zmap", 6);
+  }
+
+
+static void ActorPath(Rom *rom, char *filePath, uint32_t id, uint32_t group, uint32_t objectId,
+                      int32_t fileNum)
+  {
+    uint32_t n;
+    strcpy(filePath, "data/actors/");
+    switch (group) {
+        case 1:
+            strcat(filePath, "props (1)");
+            break;
+        case 2:
+            strcat(filePath, "player");
+            break;
+        case 3:
+            strcat(filePath, "bombs");
+            break;
+        case 4:
+            strcat(filePath, "npcs");
+            break;
+        case 5:
+            strcat(filePath, "enemies");
+            break;
+        case 6:
+            strcat(filePath, "props (2)");
+            break;
+        case 7:
+            strcat(filePath, "items and actions");
+            break;
+        case 8:
+            strcat(filePath, "misc");
+            break;
+        case 9:
+            strcat(filePath, "bosses");
+            break;
+        case 10:
+            strcat(filePath, "doors");
+            break;
+        case 11:
+            strcat(filePath, "chests");
+            break;
+        default:
+            sprintf(filePath + strlen(filePath), "unknown group %02X", group);
+            break;
+    }
+    n = strlen(filePath);
+    n += sprintf(filePath + n, "/%03X [obj %03X] - ", id, objectId);
+    n += GetFileName(rom, filePath + n, fileNum);
+    memcpy(filePath + n, ".zactor", 8);
+  }
+
+
+static void ObjectPath(Rom *rom, char *filePath, uint32_t id, int32_t fileNum)
+  {
+    uint32_t n;
+    if (id == 1)
+      n = sprintf(filePath, "data/gk_%03X - ", id);
+    else if (id == 2)
+      n = sprintf(filePath, "data/fk_%03X - ", id);
+    else if (id == 3)
+      n = sprintf(filePath, "data/dk_%03X - ", id);
+    else
+      n = sprintf(filePath, "data/objects/%03X - ", id);
+    n += GetFileName(rom, &filePath[n], fileNum);
+    memcpy(&filePath[n], ".zobj", 6);
+  }
+
+
+/* Z64Rebuild(rom) looks for every file Z64Extract(rom) would write under
+ * the same paths, in data/ or in an archive, and puts the ones that differ
+ * from the rom's own back in:
+ *
+ *   - the paths are worked out from the rom the same way extraction does,
+ *     so an actor is still found under the group and object it had
+ *   - a changed file keeps its vrom start if it still fits in its old range
+ *     and otherwise moves past the end of the last file, so only references
+ *     to files that changed ever have to be patched: the scene, object and
+ *     actor tables in code and the map lists of the scenes
+ *   - files are compressed again if they were before, in parallel
+ *   - everything after dmadata is packed again in file table order; files
+ *     up to and including dmadata stay where they are
+ *   - the boot checksum is recalculated if the original rom had a valid one
+ */
+static int RebuildAddPath(Rebuild *rebuild, int32_t file, const char *path)
+  {
+    RebuildPath *paths;
+    uint32_t capacity;
+    if (rebuild->pathCount == rebuild->pathCapacity)
+      {
+        capacity = rebuild->pathCapacity ? rebuild->pathCapacity * 2 : 1024;
+        if (!(paths = (RebuildPath *) realloc(rebuild->paths, capacity * sizeof(RebuildPath))))
+          return 0;
+        rebuild->paths = paths;
+        rebuild->pathCapacity = capacity;
+      }
+    if (!(rebuild->paths[rebuild->pathCount].path = strdup(path)))
+      return 0;
+    rebuild->paths[rebuild->pathCount++].file = file;
+    return 1;
+  }
+
+
+/* the same walk as ListScenesAndMaps(rom) and friends, collecting paths */
+static int RebuildPaths(Rebuild *rebuild)
+  {
+    Rom *rom = rebuild->rom;
+    uint32_t id, i, j, k, w0, w1, info, group, objectId, mapCount, mapList, count;
+    int32_t fileNum;
+    char path[512];
+    FileTableEntry fte;
+    int ok = 1;
+    count = GetTableLength(rom, rom->sceneTable.start, rom->steSize);
+    for (id = 0; ok && id < count; id++)
+      {
+        i = rom->sceneTable.start + id * rom->steSize;
+        w0 = READ32(&rom->code.data[i]);
+        w1 = READ32(&rom->code.data[i + 4]);
+        if (!w0 || !IdSelected(rom, id) || (fileNum = GetFileNumber(rom, w0, w1)) < 0)
+          continue;
+        if (Extracts(rom, Z64_EXTRACT_SCENES) && NameSelected(rom, fileNum))
+          {
+            ScenePath(rom, path, id, fileNum);
+            ok = RebuildAddPath(rebuild, fileNum, path);
+          }
+        if (!Extracts(rom, Z64_EXTRACT_MAPS) || !GetFilePrefix(rom, &fte, fileNum, SCENE_HEADER))
+          continue;
+        for (j = 0; ok && NextMapList(rom, &fte, &j, &mapCount, &mapList);)
+          {
+            for (k = 0; ok && k < mapCount && mapList + k * 8 + 8 <= fte.size; k++)
+              {
+                fileNum = GetFileNumber(rom, READ32(&fte.data[mapList + k * 8]), 0);
+                if (fileNum < 0 || !NameSelected(rom, fileNum))
+                  continue;
+                MapPath(rom, path, id, fileNum);
+                ok = RebuildAddPath(rebuild, fileNum, path);
+              }
+          }
+        PutFile(rom, &fte);
+      }
+    count = Extracts(rom, Z64_EXTRACT_ACTORS) ? GetTableLength(rom, rom->actorTable.start, 32) : 0;
+    for (id = 0; ok && id < count; id++)
+      {
+        i = rom->actorTable.start + id * 32;
+        info = READ32(&rom->code.data[i + 20]) - READ32(&rom->code.data[i + 8]);
+        if (!READ32(&rom->code.data[i]) || !IdSelected(rom, id) ||
+            (fileNum = GetFileNumber(rom, READ32(&rom->code.data[i]),
+                                     READ32(&rom->code.data[i + 4]))) < 0 ||
+            !NameSelected(rom, fileNum) || !GetFilePrefix(rom, &fte, fileNum, info + 10))
+          continue;
+        group = objectId = 0;
+        if (info < fte.size && fte.size - info >= 10)
+          {
+            group = fte.data[info + 2];
+            objectId = (fte.data[info + 8] << 8) | fte.data[info + 9];
+          }
+        PutFile(rom, &fte);
+        if (rom->options.categories && (group > 31 || !(rom->options.categories & (1u << group))))
+          continue;
+        ActorPath(rom, path, id, group, objectId, fileNum);
+        ok = RebuildAddPath(rebuild, fileNum, path);
+      }
+    count = Extracts(rom, Z64_EXTRACT_OBJECTS) ? GetTableLength(rom, rom->objectTable.start, 8) : 0;
+    for (id = 0; ok && id < count; id++)
+      {
+        i = rom->objectTable.start + id * 8;
+        w0 = READ32(&rom->code.data[i]);
+        w1 = READ32(&rom->code.data[i + 4]);
+        if (!w0 || !IdSelected(rom, id) || (fileNum = GetFileNumber(rom, w0, w1)) < 0 ||
+            !NameSelected(rom, fileNum))
+          continue;
+        ObjectPath(rom, path, id, fileNum);
+        ok = RebuildAddPath(rebuild, fileNum, path);
+      }
+    return ok;
+  }
+
+
+static int CompareRebuildPaths(const void *a, const void *b)
+  {
+    const RebuildPath *x = (const RebuildPath *) a, *y = (const RebuildPath *) b;
+    if (x->file != y->file)
+      return x->file < y->file ? -1 : 1;
+    return strcmp(x->path, y->path);
+  }
+
+
+static int CompareArchiveNames(const void *a, const void *b)
+  {
+    return strcmp(((const ArchiveEntry *) a)->name, ((const ArchiveEntry *) b)->name);
+  }
+
+
+/* Reads the index of an archive written by ArchiveFinish(rom), sorted by
+ * name so RebuildRead(rebuild) can look paths up.
+ */
+static int RebuildArchive(Rebuild *rebuild, const char *filename)
+  {
+    uint8_t header[ARCHIVE_HEADER], *index = NULL;
+    char *names = NULL;
+    uint32_t i, count, indexOffset, nameOffset, nameSize, name, length;
+    ArchiveEntry *entry;
+    int ok = 0;
+    if (!(rebuild->archive = fopen(filename, "rb")))
+      return 0;
+    if (fread(header, 1, ARCHIVE_HEADER, rebuild->archive) != ARCHIVE_HEADER ||
+        memcmp(header, "Z64DUMPA", 8) || READ32(&header[8]) != 1)
+      return 0;
+    count = READ32(&header[12]);
+    indexOffset = READ32(&header[16]);
+    nameOffset = READ32(&header[20]);
+    nameSize = READ32(&header[24]);
+    if (count > 0x1000000 || nameSize > 0x10000000 ||
+        !(index = (uint8_t *) malloc(count * ARCHIVE_ENTRY + 1)) ||
+        !(names = (char *) malloc(nameSize + 1)) ||
+        !(rebuild->entries = (ArchiveEntry *) calloc(count + 1, sizeof(ArchiveEntry))) ||
+        fseek(rebuild->archive, indexOffset, SEEK_SET) ||
+        fread(index, ARCHIVE_ENTRY, count, rebuild->archive) != count ||
+        fseek(rebuild->archive, nameOffset, SEEK_SET) ||
+        fread(names, 1, nameSize, rebuild->archive) != nameSize)
+      {
+        free(index);
+        free(names);
+        return 0;
+      }
+    for (i = 0; i < count; i++)
+      {
+        entry = &rebuild->entries[i];
+        length = index[i * ARCHIVE_ENTRY + 6] << 8 | index[i * ARCHIVE_ENTRY + 7];
+        name = READ32(&index[i * ARCHIVE_ENTRY + 12]);
+        if (name > nameSize || length > nameSize - name || !(entry->name = (char *) malloc(length + 1)))
+          break;
+        memcpy(entry->name, &names[name], length);
+        entry->name[length] = 0;
+        entry->offset = READ32(&index[i * ARCHIVE_ENTRY + 16]);
+        entry->size = READ32(&index[i * ARCHIVE_ENTRY + 20]);
+        rebuild->entryCount++;
+      }
+    if (i == count)
+      {
+        qsort(rebuild->entries, count, sizeof(ArchiveEntry), CompareArchiveNames);
+        ok = 1;
+      }
+    free(index);
+    free(names);
+    return ok;
+  }
+
+
+/* The file at path (under data/) from the archive or the output directory,
+ * or NULL if there isn't one.
+ */
+static uint8_t *RebuildLoad(Rebuild *rebuild, const char *path, uint32_t *size)
+  {
+    ArchiveEntry key, *entry;
+    char full[1024];
+    uint8_t *data = NULL;
+    long length;
+    FILE *fp;
+    int ok;
+    if (rebuild->archive)
+      {
+        key.name = (char *) path + 5;
+        if (!(entry = (ArchiveEntry *) bsearch(&key, rebuild->entries, rebuild->entryCount,
+                                               sizeof(ArchiveEntry), CompareArchiveNames)) ||
+            !(data = (uint8_t *) malloc(entry->size + 1)))
+          return NULL;
+        MutexLock(&rebuild->lock);
+        ok = !fseek(rebuild->archive, entry->offset, SEEK_SET) &&
+             fread(data, 1, entry->size, rebuild->archive) == entry->size;
+        MutexUnlock(&rebuild->lock);
+        *size = entry->size;
+      }
+    else
+      {
+        sprintf(full, "%s%s", rebuild->root, path);
+        if (!(fp = fopen(full, "rb")))
+          return NULL;
+        ok = !fseek(fp, 0, SEEK_END) && (length = ftell(fp)) >= 0 && length < 0x10000000 &&
+             !fseek(fp, 0, SEEK_SET) && (data = (uint8_t *) malloc(length + 1)) &&
+             fread(data, 1, length, fp) == (size_t) length;
+        fclose(fp);
+        *size = ok ? length : 0;
+      }
+    if (!ok)
+      {
+        free(data);
+        return NULL;
+      }
+    return data;
+  }
+
+
+/* Takes the first of the file's paths whose contents differ from the rom. */
+static void RebuildRead(void *arg, uint32_t index)
+  {
+    Rebuild *rebuild = (Rebuild *) arg;
+    RebuildFile *file = &rebuild->files[index];
+    RebuildPath *path = &rebuild->paths[file->path];
+    FileTableEntry fte;
+    uint32_t i, size;
+    uint8_t *data;
+    if (!file->paths || !GetFile(rebuild->rom, &fte, index))
+      return;
+    for (i = 0; i < file->paths; i++)
+      {
+        if (!(data = RebuildLoad(rebuild, path[i].path, &size)))
+          continue;
+        if (size != fte.size || memcmp(data, fte.data, size))
+          {
+            file->raw = data;
+            file->rawSize = size;
+            break;
+          }
+        free(data);
+      }
+    PutFile(rebuild->rom, &fte);
+  }
+
+
+/* a writable copy of file index for patching, NULL (and the reason in
+ * rebuild->status) if it can't be had
+ */
+static uint8_t *RebuildEdit(Rebuild *rebuild, int32_t index)
+  {
+    RebuildFile *file = &rebuild->files[index];
+    FileTableEntry fte;
+    if (file->raw)
+      return file->raw;
+    if (!GetFile(rebuild->rom, &fte, index))
+      {
+        rebuild->status = Z64_ERROR_DECODE;
+        return NULL;
+      }
+    if ((file->raw = (uint8_t *) malloc(fte.size + 1)))
+      {
+        memcpy(file->raw, fte.data, fte.size);
+        file->rawSize = fte.size;
+      }
+    else
+      rebuild->status = Z64_ERROR_MEMORY;
+    PutFile(rebuild->rom, &fte);
+    return file->raw;
+  }
+
+
+/* True if the vrom range at data (start, end) is no longer where its file
+ * is.  Map lists are matched on the start alone, like ExtractScene(rom) does.
+ */
+static int RebuildMoved(Rebuild *rebuild, const uint8_t *data, int map, int32_t *fileNum)
+  {
+    uint32_t w0 = READ32(data), w1 = READ32(&data[4]);
+    *fileNum = w0 ? GetFileNumber(rebuild->rom, w0, map ? 0 : w1) : -1;
+    return *fileNum >= 0 && (rebuild->files[*fileNum].start != w0 ||
+                             rebuild->files[*fileNum].end != w1);
+  }
+
+
+/* Gives every changed file its vrom range and patches the tables in code and
+ * the map lists of the scenes to match.  Runs before anything is compressed,
+ * since it can change files that weren't otherwise.
+ */
+static int RebuildPatch(Rebuild *rebuild)
+  {
+    Rom *rom = rebuild->rom;
+    RebuildFile *file;
+    FileTableEntry fte;
+    uint32_t i, j, k, t, top = 0, count = rom->fileTable.size / 16, start, stride, length;
+    uint32_t mapCount, mapList, offset;
+    int32_t fileNum, scene;
+    uint8_t *data;
+    for (i = 0; i < count; i++)
+      {
+        READFTE(&fte, &rom->data[rom->fileTable.start + i * 16]);
+        rebuild->files[i].start = fte.virtual.start;
+        rebuild->files[i].end = fte.virtual.end;
+        if (fte.virtual.end > top)
+          top = fte.virtual.end;
+      }
+    top = (top + 15) & ~15;
+    for (i = 0; i < count; i++)
+      {
+        file = &rebuild->files[i];
+        if (!file->raw)
+          continue;
+        if (file->rawSize > file->end - file->start)
+          {
+            file->start = top;
+            top = (top + file->rawSize + 15) & ~15;
+            rebuild->moved++;
+          }
+        file->end = file->start + file->rawSize;
+      }
+    for (t = 0; t < 3; t++)
+      {
+        stride = GetTableStride(rom, t, &start);
+        length = GetTableLength(rom, start, stride);
+        for (i = 0; i < length; i++)
+          {
+            offset = start + i * stride;
+            if (!RebuildMoved(rebuild, &rom->code.data[offset], 0, &fileNum))
+              continue;
+            if (!(data = RebuildEdit(rebuild, rom->code.index)))
+              return 0;
+            /* an overlay is loaded as it is, so its vram range grows with it */
+            file = &rebuild->files[fileNum];
+            if (t == Z64_ACTORS && READ32(&data[offset + 8]) &&
+                file->end - file->start != READ32(&data[offset + 4]) - READ32(&data[offset]))
+              WRITE32(&data[offset + 12], READ32(&data[offset + 8]) + file->end - file->start);
+            WRITE32(&data[offset], file->start);
+            WRITE32(&data[offset + 4], file->end);
+          }
+      }
+    length = GetTableLength(rom, rom->sceneTable.start, rom->steSize);
+    for (i = 0; i < length; i++)
+      {
+        offset = rom->sceneTable.start + i * rom->steSize;
+        if (!READ32(&rom->code.data[offset]) ||
+            (scene = GetFileNumber(rom, READ32(&rom->code.data[offset]),
+                                   READ32(&rom->code.data[offset + 4]))) < 0)
+          continue;
+        /* a replaced scene is patched in place, anything else is read from the rom */
+        if (rebuild->files[scene].raw)
+          {
+            fte.data = rebuild->files[scene].raw;
+            fte.size = rebuild->files[scene].rawSize;
+            fte.index = scene;
+            fte.owner = FILE_VIEW;
+          }
+        else if (!GetFile(rom, &fte, scene))
+          {
+            /* its map list may point at a file that moved */
+            if (!rebuild->moved)
+              continue;
+            rebuild->status = Z64_ERROR_DECODE;
+            return 0;
+          }
+        for (j = 0; NextMapList(rom, &fte, &j, &mapCount, &mapList);)
+          {
+            for (k = 0; k < mapCount && mapList + k * 8 + 8 <= fte.size; k++)
+              {
+                if (!RebuildMoved(rebuild, &fte.data[mapList + k * 8], 1, &fileNum))
+                  continue;
+                if (!(data = RebuildEdit(rebuild, scene)))
+                  {
+                    PutFile(rom, &fte);
+                    return 0;
+                  }
+                if (fte.data != data)
+                  {
+                    PutFile(rom, &fte);
+                    fte.data = data;
+                    fte.owner = FILE_VIEW;
+                  }
+                WRITE32(&data[mapList + k * 8], rebuild->files[fileNum].start);
+                WRITE32(&data[mapList + k * 8 + 4], rebuild->files[fileNum].end);
+              }
+          }
+        PutFile(rom, &fte);
+      }
+    return 1;
+  }
+
+
+/* compresses a changed file again if the rom had it compressed; yaz0enc()
+ * can't fail with the room it's given, so only the allocation can
+ */
+static void RebuildPack(void *arg, uint32_t index)
+  {
+    Rebuild *rebuild = (Rebuild *) arg;
+    RebuildFile *file = &rebuild->files[index];
+    FileTableEntry fte;
+    uint32_t srcSize;
+    if (!file->raw)
+      return;
+    if (FindFile(rebuild->rom, &fte, index, &srcSize) != SOURCE_YAZ0)
+      {
+        file->packed = file->raw;
+        file->packedSize = file->rawSize;
+        return;
+      }
+    if (!(file->packed = (uint8_t *) malloc(file->rawSize + file->rawSize / 8 + 48)))
+      {
+        rebuild->status = Z64_ERROR_MEMORY;
+        return;
+      }
+    file->packedSize = yaz0enc(file->raw, file->rawSize, file->packed);
+  }
+
+
+/* Lays the files out in a new image and fills in their file table entries.
+ * Returns NULL if it can't be allocated.
+ */
+static uint8_t *RebuildLayout(Rebuild *rebuild, uint32_t *romSize)
+  {
+    Rom *rom = rebuild->rom;
+    RebuildFile *file;
+    FileTableEntry fte;
+    uint32_t i, count = rom->fileTable.size / 16, fixed = rom->fileTable.start + rom->fileTable.size;
+    uint32_t pos, size, srcSize, capacity;
+    const uint8_t *data;
+    uint8_t *out, *entry;
+    int source;
+    /* makerom, boot and dmadata (and whatever else is in front of it) stay */
+    for (i = 0; i < count; i++)
+      {
+        if ((source = FindFile(rom, &fte, i, &srcSize)) == SOURCE_NONE ||
+            fte.physical.start >= rom->fileTable.start + rom->fileTable.size ||
+            rebuild->files[i].raw)
+          continue;
+        size = source == SOURCE_YAZ0 ? srcSize : fte.size;
+        if (fte.physical.start + size > fixed)
+          fixed = fte.physical.start + size;
+      }
+    fixed = (fixed + 15) & ~15;
+    for (capacity = fixed, i = 0; i < count; i++)
+      {
+        if ((source = FindFile(rom, &fte, i, &srcSize)) != SOURCE_NONE)
+          capacity += (rebuild->files[i].raw ? rebuild->files[i].packedSize :
+                       source == SOURCE_YAZ0 ? srcSize : fte.size) + 15;
+      }
+    capacity = capacity > rom->size ? (capacity + 0xFFFFF) & ~0xFFFFF : rom->size;
+    if (fixed > rom->size || !(out = (uint8_t *) calloc(capacity, 1)))
+      return NULL;
+    memcpy(out, rom->data, fixed);
+    for (pos = fixed, i = 0; i < count; i++)
+      {
+        file = &rebuild->files[i];
+        entry = &out[rom->fileTable.start + i * 16];
+        if ((source = FindFile(rom, &fte, i, &srcSize)) == SOURCE_NONE ||
+            (fte.physical.start < rom->fileTable.start + rom->fileTable.size && !file->raw))
+          continue;
+        if (file->raw)
+          {
+            data = file->packed;
+            size = file->packedSize;
+          }
+        else
+          {
+            data = &rom->data[fte.physical.start];
+            size = source == SOURCE_YAZ0 ? srcSize : fte.size;
+          }
+        memcpy(&out[pos], data, size);
+        WRITE32(entry, file->start);
+        WRITE32(&entry[4], file->end);
+        WRITE32(&entry[8], pos);
+        /* plain files keep whichever end convention they had */
+        if (source == SOURCE_YAZ0 || fte.physical.end)
+          WRITE32(&entry[12], pos + size);
+        pos = (pos + size + 15) & ~15;
+      }
+    *romSize = pos > rom->size ? (pos + 0xFFFFF) & ~0xFFFFF : rom->size;
+    return out;
+  }
+
+
+/* The boot code checks two words at 0x10 over the megabyte after it, seeded
+ * differently for each CIC.  Which one a rom has only shows in which sum
+ * matches, so the rebuilt rom gets whichever matched the original, and none
+ * if the original didn't have a valid one.
+ */
+static void RomChecksum(const uint8_t *data, int cic, uint32_t crc[2])
+  {
+    static const uint32_t seeds[] = {0xF8CA4DDC, 0xA3886759, 0xDF26F436, 0x1FEA617A};
+    uint32_t t1, t2, t3, t4, t5, t6, d, r, i;
+    t1 = t2 = t3 = t4 = t5 = t6 = seeds[cic];
+    for (i = 0x1000; i < 0x101000; i += 4)
+      {
+        d = READ32(&data[i]);
+        if (t6 + d < t6)
+          t4++;
+        t6 += d;
+        t3 ^= d;
+        r = d & 31 ? (d << (d & 31)) | (d >> (32 - (d & 31))) : d;
+        t5 += r;
+        if (t2 > d)
+          t2 ^= r;
+        else
+          t2 ^= t6 ^ d;
+        /* 6105 mixes in its boot code */
+        if (cic == CIC_6105)
+          t1 += (uint32_t) READ32(&data[0x750 + (i & 0xFF)]) ^ d;
+        else
+          t1 += t5 ^ d;
+      }
+    if (cic == CIC_6103)
+      {
+        crc[0] = (t6 ^ t4) + t3;
+        crc[1] = (t5 ^ t2) + t1;
+      }
+    else if (cic == CIC_6106)
+      {
+        crc[0] = t6 * t4 + t3;
+        crc[1] = t5 * t2 + t1;
+      }
+    else
+      {
+        crc[0] = t6 ^ t4 ^ t3;
+        crc[1] = t5 ^ t2 ^ t1;
+      }
+  }
+
+
+static int RebuildChecksum(Rom *rom, uint8_t *out, uint32_t size)
+  {
+    uint32_t crc[2];
+    int cic;
+    if (rom->size < 0x101000 || size < 0x101000)
+      return 0;
+    for (cic = CIC_6102; cic <= CIC_6106; cic++)
+      {
+        RomChecksum(rom->data, cic, crc);
+        if (crc[0] == READ32(&rom->data[0x10]) && crc[1] == READ32(&rom->data[0x14]))
+          {
+            RomChecksum(out, cic, crc);
+            WRITE32(&out[0x10], crc[0]);
+            WRITE32(&out[0x14], crc[1]);
+            return 1;
+          }
+      }
+    return 0;
+  }
+
+
+static void RebuildFree(Rebuild *rebuild)
+  {
+    uint32_t i;
+    for (i = 0; rebuild->files && i < rebuild->rom->fileTable.size / 16; i++)
+      {
+        if (rebuild->files[i].packed != rebuild->files[i].raw)
+          free(rebuild->files[i].packed);
+        free(rebuild->files[i].raw);
+      }
+    for (i = 0; i < rebuild->pathCount; i++)
+      free(rebuild->paths[i].path);
+    for (i = 0; i < rebuild->entryCount; i++)
+      free(rebuild->entries[i].name);
+    if (rebuild->archive)
+      fclose(rebuild->archive);
+    free(rebuild->files);
+    free(rebuild->paths);
+    free(rebuild->entries);
+  }
+
+
+/* The catalog for Z64List() walks the tables the same way the extract
+ * phases do, but serially so the rows come out in table order.
+ */
+static const char *RomName(Rom *rom)
+  {
+    const char *name = rom->filename, *p;
+    for (p = name; *p; p++)
+      {
+        if (*p == '/' || *p == '\\')
+          name = p + 1;
+      }
+    return name;
+  }
+
+
+static void PrintJsonString(FILE *out, const char *s)
+  {
+    fputc('"', out);
+    for (; *s; s++)
+      {
+        if (*s == '"' || *s == '\\')
+          fprintf(out, "\\%c", *s);
+        else if ((uint8_t) *s < 0x20)
+          fprintf(out, "\\u%04X", (uint8_t) *s);
+        else
+          fputc(*s, out);
+      }
+    fputc('"', out);
+  }
+
+
+/* a quoted csv field; quotes inside are doubled */
+static void PrintCsvString(FILE *out, const char *s)
+  {
+    fputc('"', out);
+    for (; *s; s++)
+      {
+        if (*s == '"')
+          fputc('"', out);
+        fputc(*s, out);
+      }
+    fputc('"', out);
+  }
+
+
+static void CatalogBegin(Rom *rom, Catalog *catalog)
+  {
+    const char *game = rom->isMM ? "mm" : "oot";
+    switch (catalog->format)
+      {
+        case Z64_LIST_JSON:
+          fprintf(catalog->out, "{\n  \"rom\": ");
+          PrintJsonString(catalog->out, RomName(rom));
+          fprintf(catalog->out, ",\n  \"game\": \"%s\",\n  \"files\": %u,\n  \"fileTable\": %u,\n"
+                  "  \"code\": %i,\n  \"sceneTable\": %u,\n  \"objectTable\": %u,\n"
+                  "  \"actorTable\": %u,\n  \"entries\": [", game, rom->fileTable.size / 16,
+                  rom->fileTable.start, rom->code.index,
+                  rom->code.virtual.start + rom->sceneTable.start,
+                  rom->code.virtual.start + rom->objectTable.start,
+                  rom->code.virtual.start + rom->actorTable.start);
+          break;
+        case Z64_LIST_CSV:
+          fprintf(catalog->out, "kind,id,sub,file,name,vrom_start,vrom_end,rom_start,rom_end,"
+                  "compressed,size,category,object\n");
+          break;
+        default:
+          fprintf(catalog->out, "%s (%s): %u files, file table %08X, code %08X - %08X\n",
+                  RomName(rom), game, rom->fileTable.size / 16, rom->fileTable.start,
+                  rom->code.virtual.start, rom->code.virtual.end);
+          fprintf(catalog->out, "%-6s %4s %4s %3s %5s  %-17s  %-17s  %8s  %8s  %s\n", "kind", "id",
+                  "sub", "cat", "file", "vrom", "rom", "rom size", "size", "name");
+          break;
+      }
+  }
+
+
+static void CatalogEnd(Rom *rom, Catalog *catalog)
+  {
+    if (catalog->format == Z64_LIST_JSON)
+      fprintf(catalog->out, "%s]\n}\n", catalog->rows ? "\n  " : "");
+    else if (catalog->format != Z64_LIST_CSV)
+      fprintf(catalog->out, "%u files\n", catalog->rows);
+  }
+
+
+/* sub is the map number for maps and the object for actors; group is -1
+ * for anything but actors
+ */
+static void CatalogRow(Rom *rom, Catalog *catalog, const char *kind, uint32_t id, uint32_t sub,
+                       int32_t index, int group)
+  {
+    FileTableEntry fte;
+    char name[MAX_NAME + 1], category[16];
+    uint32_t srcSize, romEnd;
+    int source = FindFile(rom, &fte, index, &srcSize);
+    if (source == SOURCE_NONE)
+      return;
+    GetFileName(rom, name, index);
+    romEnd = fte.physical.start + srcSize;
+    switch (catalog->format)
+      {
+        case Z64_LIST_JSON:
+          fprintf(catalog->out, "%s\n    {\"kind\": \"%s\", \"id\": %u, \"sub\": %u, \"file\": %i, "
+                  "\"name\": ", catalog->rows ? "," : "", kind, id, sub, index);
+          PrintJsonString(catalog->out, name);
+          fprintf(catalog->out, ", \"vrom\": [%u, %u], \"rom\": [%u, %u], \"compressed\": %s, "
+                  "\"size\": %u", fte.virtual.start, fte.virtual.end, fte.physical.start, romEnd,
+                  source == SOURCE_YAZ0 ? "true" : "false", fte.size);
+          if (group >= 0)
+            fprintf(catalog->out, ", \"category\": %i, \"object\": %u", group, sub);
+          fputc('}', catalog->out);
+          break;
+        case Z64_LIST_CSV:
+          fprintf(catalog->out, "%s,%u,%u,%i,", kind, id, sub, index);
+          PrintCsvString(catalog->out, name);
+          fprintf(catalog->out, ",%u,%u,%u,%u,%i,%u,", fte.virtual.start, fte.virtual.end,
+                  fte.physical.start, romEnd, source == SOURCE_YAZ0, fte.size);
+          if (group >= 0)
+            fprintf(catalog->out, "%i,%u\n", group, sub);
+          else
+            fprintf(catalog->out, ",\n");
+          break;
+        default:
+          if (group >= 0)
+            sprintf(category, "%3i", group);
+          fprintf(catalog->out, "%-6s %4u %4u %3s %5i  %08X-%08X  %08X-%08X  %8u  %8u  %s\n", kind,
+                  id, sub, group >= 0 ? category : "", index, fte.virtual.start, fte.virtual.end,
+                  fte.physical.start, romEnd, srcSize, fte.size, name);
+          break;
+      }
+    catalog->rows++;
+  }
+
+
+static void ListScenesAndMaps(Rom *rom, Catalog *catalog)
+  {
+    uint32_t id, i, j, k, w0, w1, mapCount, mapList;
+    uint32_t count = GetTableLength(rom, rom->sceneTable.start, rom->steSize);
+    int32_t fileNum;
+    FileTableEntry fte;
+    for (id = 0; id < count; id++)
+      {
+        i = rom->sceneTable.start + id * rom->steSize;
+        w0 = READ32(&rom->code.data[i]);
+        w1 = READ32(&rom->code.data[i + 4]);
+        if (!w0 || !IdSelected(rom, id) || (fileNum = GetFileNumber(rom, w0, w1)) < 0)
+          continue;
+        if (Extracts(rom, Z64_EXTRACT_SCENES) && NameSelected(rom, fileNum))
+          CatalogRow(rom, catalog, "scene", id, 0, fileNum, -1);
+        if (!Extracts(rom, Z64_EXTRACT_MAPS) || !GetFilePrefix(rom, &fte, fileNum, SCENE_HEADER))
+          continue;
+        for (j = 0; NextMapList(rom, &fte, &j, &mapCount, &mapList);)
+          {
+            for (k = 0; k < mapCount && mapList + k * 8 + 8 <= fte.size; k++)
+              {
+                fileNum = GetFileNumber(rom, READ32(&fte.data[mapList + k * 8]), 0);
+                if (fileNum >= 0 && NameSelected(rom, fileNum))
+                  CatalogRow(rom, catalog, "map", id, k, fileNum, -1);
+              }
+          }
+        PutFile(rom, &fte);
+      }
+  }
+
+
+static void ListActors(Rom *rom, Catalog *catalog)
+  {
+    uint32_t id, i, info, group, objectId, count = GetTableLength(rom, rom->actorTable.start, 32);
+    int32_t fileNum;
+    FileTableEntry fte;
+    for (id = 0; id < count; id++)
+      {
+        i = rom->actorTable.start + id * 32;
+        info = READ32(&rom->code.data[i + 20]) - READ32(&rom->code.data[i + 8]);
+        if (!READ32(&rom->code.data[i]) || !IdSelected(rom, id) ||
+            (fileNum = GetFileNumber(rom, READ32(&rom->code.data[i]),
+                                     READ32(&rom->code.data[i + 4]))) < 0 ||
+            !NameSelected(rom, fileNum) || !GetFilePrefix(rom, &fte, fileNum, info + 10))
+          continue;
+        group = objectId = 0;
+        if (info < fte.size && fte.size - info >= 10)
+          {
+            group = fte.data[info + 2];
+            objectId = (fte.data[info + 8] << 8) | fte.data[info + 9];
+          }
+        PutFile(rom, &fte);
+        if (!rom->options.categories || (group < 32 && (rom->options.categories & (1u << group))))
+          CatalogRow(rom, catalog, "actor", id, objectId, fileNum, group);
+      }
+  }
+
+
+static void ListObjects(Rom *rom, Catalog *catalog)
+  {
+    uint32_t id, i, count = GetTableLength(rom, rom->objectTable.start, 8);
+    int32_t fileNum;
+    for (id = 0; id < count; id++)
+      {
+        i = rom->objectTable.start + id * 8;
+        if (READ32(&rom->code.data[i]) && IdSelected(rom, id) &&
+            (fileNum = GetFileNumber(rom, READ32(&rom->code.data[i]),
+                                     READ32(&rom->code.data[i + 4]))) >= 0 &&
+            NameSelected(rom, fileNum))
+          CatalogRow(rom, catalog, "object", id, 0, fileNum, -1);
+      }
+  }
+
+
+/* Output goes through a single writer thread fed by a bounded queue, so the
+ * extraction threads never block on the filesystem unless the queue is full.
+ * The writer creates directories the first time a file lands in them and
+ * keeps them open, writing files relative to the directory handle with
+ * openat() / pwrite() instead of resolving the whole path every time.
+ */
+#ifdef _WIN32
+/* there are no *at() calls here, so paths are joined to the output root */
+static const char *RootPath(Writer *writer, const char *path, char *buffer)
+  {
+    sprintf(buffer, "%s%s", writer->root, path);
+    return buffer;
+  }
+#endif
+
+
+static Directory *GetDirectory(Rom *rom, const char *path, uint32_t length)
+  {
+    Writer *writer = &rom->writer;
+    Directory *dir;
+    uint32_t h = 0, i, slash = 0;
+    for (i = 0; i < length; i++)
+      {
+        h = h * 31 + (uint8_t) path[i];
+        if (path[i] == '/')
+          slash = i + 1;
+      }
+    h &= 255;
+    for (dir = writer->dirs[h]; dir; dir = dir->next)
+      {
+        if (strlen(dir->path) == length && !memcmp(dir->path, path, length))
+          return dir;
+      }
+    if (!(dir = (Directory *) malloc(sizeof(Directory))) ||
+        !(dir->path = (char *) malloc(length + 1)))
+      {
+        free(dir);
+        return NULL;
+      }
+    memcpy(dir->path, path, length);
+    dir->path[length] = 0;
+#ifdef _WIN32
+    char full[1024];
+    /* _mkdir() makes one level, so the parents go first */
+    if (slash > 1 && !GetDirectory(rom, path, slash - 1))
+      {
+        free(dir->path);
+        free(dir);
+        return NULL;
+      }
+    mkdir(RootPath(writer, dir->path, full));
+    dir->fd = 0;
+#else
+    int parent;
+    if (!slash)
+      parent = writer->rootFd;
+    else if (slash == 1)
+      parent = open("/", O_RDONLY | O_DIRECTORY);
+    else
+      {
+        Directory *up = GetDirectory(rom, path, slash - 1);
+        parent = up ? up->fd : -1;
+      }
+    mkdirat(parent, &dir->path[slash], 0777);
+    dir->fd = openat(parent, &dir->path[slash], O_RDONLY | O_DIRECTORY);
+    if (slash == 1 && parent >= 0)
+      close(parent);
+    if (dir->fd < 0)
+      {
+        free(dir->path);
+        free(dir);
+        return NULL;
+      }
+#endif
+    dir->next = writer->dirs[h];
+    writer->dirs[h] = dir;
+    return dir;
+  }
+
+
+static int WriteOutput(Rom *rom, const char *path, const uint8_t *data, uint32_t size)
+  {
+    Writer *writer = &rom->writer;
+    const char *name = strrchr(path, '/');
+    Directory *dir = NULL;
+    if (name && !(dir = GetDirectory(rom, path, name - path)))
+      return 0;
+#ifdef _WIN32
+    char full[1024];
+    FILE *fp;
+    if (writer->incremental)
+      DeleteFileA(RootPath(writer, path, full));
+    if (!(fp = fopen(RootPath(writer, path, full), "wb")))
+      return 0;
+    rom->stats.writtenBytes += size;
+    size = fwrite(data, 1, size, fp) == size;
+    return !fclose(fp) && size;
+#else
+    uint32_t offset = 0;
+    ssize_t n;
+    int fd;
+    /* a skipped file may be a --dedup hardlink to this one */
+    if (writer->incremental)
+      unlinkat(dir ? dir->fd : writer->rootFd, name ? name + 1 : path, 0);
+    fd = openat(dir ? dir->fd : writer->rootFd, name ? name + 1 : path,
+                O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0)
+      return 0;
+    for (; offset < size; offset += n)
+      {
+        if ((n = pwrite(fd, &data[offset], size - offset, offset)) <= 0)
+          break;
+      }
+    rom->stats.writtenBytes += offset;
+    return !close(fd) && offset == size;
+#endif
+  }
+
+
+/* With --archive the writer appends every file to a single pack instead:
+ *
+ *   header   "Z64DUMPA", version, entry count, index offset, name offset,
+ *            name table size (all big endian, padded to 32 bytes)
+ *   payloads each aligned to 16 bytes, in index order
+ *   index    one 32 byte entry per file, sorted by type, table id, sub id:
+ *            type, flags, table id, sub id, name length, file index,
+ *            name offset, data offset, size, vrom start, reserved
+ *            (with --dedup, ARCHIVE_SHARED entries point at the payload
+ *            of an earlier identical file)
+ *   names    the paths the files would have had under data/, not terminated
+ *
+ * The writer gets files in whatever order the threads finish them, so the
+ * payloads go to a spool file first and ArchiveFinish(rom) copies them over
+ * in index order; that way the same rom always gives the same archive.  Until
+ * then an entry's offset is where its payload is in the spool (plus the
+ * header).  Everything is written front to back; only the header is
+ * rewritten once the index is known.
+ */
+static int ArchiveOutput(Rom *rom, WriteRequest *request, uint32_t shared)
+  {
+    Writer *writer = &rom->writer;
+    static const uint8_t padding[16] = {0};
+    ArchiveEntry *entry;
+    const char *name = request->path;
+    uint32_t pad = -request->file.size & 15, length;
+    if (!strncmp(name, "data/", 5))
+      name += 5;
+    length = strlen(name);
+    if (!shared && writer->offset + (uint64_t) request->file.size + pad > 0xFFFFFFFF)
+      return 0;
+    if (writer->entryCount == writer->entryCapacity)
+      {
+        uint32_t capacity = writer->entryCapacity ? writer->entryCapacity * 2 : 1024;
+        if (!(entry = (ArchiveEntry *) realloc(writer->entries, capacity * sizeof(ArchiveEntry))))
+          return 0;
+        writer->entries = entry;
+        writer->entryCapacity = capacity;
+      }
+    entry = &writer->entries[writer->entryCount];
+    if (!(entry->name = (char *) malloc(length + 1)))
+      return 0;
+    memcpy(entry->name, name, length + 1);
+    if (shared)
+      pad = 0;
+    else if (fwrite(request->file.data, 1, request->file.size, writer->spool) != request->file.size ||
+             fwrite(padding, 1, pad, writer->spool) != pad)
+      {
+        free(entry->name);
+        return 0;
+      }
+    entry->file = request->file.index;
+    entry->vrom = request->file.virtual.start;
+    entry->offset = shared ? shared : writer->offset;
+    entry->size = request->file.size;
+    entry->table = request->table;
+    entry->sub = request->sub;
+    entry->type = request->type;
+    entry->flags = shared ? ARCHIVE_SHARED : 0;
+    if (!shared)
+      {
+        writer->offset += request->file.size + pad;
+        rom->stats.writtenBytes += request->file.size;
+      }
+    writer->nameSize += length;
+    writer->entryCount++;
+    return 1;
+  }
+
+
+static int CompareArchiveEntries(const void *a, const void *b)
+  {
+    const ArchiveEntry *x = (const ArchiveEntry *) a, *y = (const ArchiveEntry *) b;
+    if (x->type != y->type)
+      return x->type < y->type ? -1 : 1;
+    if (x->table != y->table)
+      return x->table < y->table ? -1 : 1;
+    if (x->sub != y->sub)
+      return x->sub < y->sub ? -1 : 1;
+    return strcmp(x->name, y->name);
+  }
+
+
+static int CompareSpoolOffsets(const void *a, const void *b)
+  {
+    const ArchiveEntry *x = *(ArchiveEntry * const *) a, *y = *(ArchiveEntry * const *) b;
+    if (x->offset != y->offset)
+      return x->offset < y->offset ? -1 : 1;
+    return x->first < y->first ? -1 : x->first > y->first;
+  }
+
+
+/* Of the entries sharing a payload (--dedup), the first in index order gets
+ * it and the rest are marked ARCHIVE_SHARED, whichever was written first.
+ */
+static int ArchiveShare(Writer *writer)
+  {
+    ArchiveEntry **bySpool;
+    uint32_t i;
+    if (!(bySpool = (ArchiveEntry **) malloc((writer->entryCount + 1) * sizeof(ArchiveEntry *))))
+      return 0;
+    for (i = 0; i < writer->entryCount; i++)
+      {
+        writer->entries[i].first = i;
+        bySpool[i] = &writer->entries[i];
+      }
+    qsort(bySpool, writer->entryCount, sizeof(ArchiveEntry *), CompareSpoolOffsets);
+    for (i = 1; i < writer->entryCount; i++)
+      {
+        if (bySpool[i]->offset == bySpool[i - 1]->offset)
+          bySpool[i]->first = bySpool[i - 1]->first;
+      }
+    free(bySpool);
+    return 1;
+  }
+
+
+/* Copies the payloads from the spool in index order, then writes the index
+ * and name table after the last one and fills in the header.  Must only be
+ * called once the queue has been flushed.
+ */
+static int ArchiveFinish(Rom *rom)
+  {
+    Writer *writer = &rom->writer;
+    static const uint8_t padding[16] = {0};
+    uint8_t header[ARCHIVE_HEADER] = "Z64DUMPA", record[ARCHIVE_ENTRY], *buffer;
+    uint32_t i, name = 0, length, names, offset = ARCHIVE_HEADER, left, n, pad;
+    ArchiveEntry *entry;
+    int ok = 1;
+    WriterFlush(rom);
+    qsort(writer->entries, writer->entryCount, sizeof(ArchiveEntry), CompareArchiveEntries);
+    if (!ArchiveShare(writer) || !(buffer = (uint8_t *) malloc(1 << 20)))
+      return 0;
+    for (i = 0; ok && i < writer->entryCount; i++)
+      {
+        entry = &writer->entries[i];
+        if (entry->first != i)
+          {
+            entry->offset = writer->entries[entry->first].offset;
+            entry->flags = ARCHIVE_SHARED;
+            continue;
+          }
+        ok = !fseek(writer->spool, entry->offset - ARCHIVE_HEADER, SEEK_SET);
+        for (left = entry->size; ok && left; left -= n)
+          {
+            n = left < (1 << 20) ? left : 1 << 20;
+            ok = fread(buffer, 1, n, writer->spool) == n && fwrite(buffer, 1, n, writer->archive) == n;
+          }
+        pad = -entry->size & 15;
+        ok = ok && fwrite(padding, 1, pad, writer->archive) == pad;
+        entry->offset = offset;
+        entry->flags = 0;
+        offset += entry->size + pad;
+      }
+    free(buffer);
+    if (!ok)
+      return 0;
+    fclose(writer->spool);
+    writer->spool = NULL;
+    writer->offset = offset;
+    names = writer->offset + writer->entryCount * ARCHIVE_ENTRY;
+    memset(record, 0, sizeof(record));
+    for (i = 0; i < writer->entryCount; i++)
+      {
+        entry = &writer->entries[i];
+        length = strlen(entry->name);
+        record[0] = entry->type;
+        record[1] = entry->flags;
+        WRITE16(&record[2], entry->table);
+        WRITE16(&record[4], entry->sub);
+        WRITE16(&record[6], length);
+        WRITE32(&record[8], (uint32_t) entry->file);
+        WRITE32(&record[12], name);
+        WRITE32(&record[16], entry->offset);
+        WRITE32(&record[20], entry->size);
+        WRITE32(&record[24], entry->vrom);
+        if (fwrite(record, 1, ARCHIVE_ENTRY, writer->archive) != ARCHIVE_ENTRY)
+          return 0;
+        name += length;
+      }
+    for (i = 0; i < writer->entryCount; i++)
+      {
+        length = strlen(writer->entries[i].name);
+        if (fwrite(writer->entries[i].name, 1, length, writer->archive) != length)
+          return 0;
+      }
+    WRITE32(&header[8], 1);
+    WRITE32(&header[12], writer->entryCount);
+    WRITE32(&header[16], writer->offset);
+    WRITE32(&header[20], names);
+    WRITE32(&header[24], writer->nameSize);
+    if (fseek(writer->archive, 0, SEEK_SET) ||
+        fwrite(header, 1, ARCHIVE_HEADER, writer->archive) != ARCHIVE_HEADER)
+      return 0;
+    i = fclose(writer->archive);
+    writer->archive = NULL;
+    return !i;
+  }
+
+
+/* A 64 bit hash over four independent lanes of 8 bytes each, so the main
+ * loop has no dependency between lanes and compilers can vectorize it.  It
+ * only has to be good enough to bucket files; Dedup(rom) still compares the
+ * bytes before sharing anything.
+ */
+#define HASH_P1			0x9E3779B185EBCA87ULL
+#define HASH_P2			0xC2B2AE3D27D4EB4FULL
+#define HASH_P3			0x165667B19E3779F9ULL
+#define ROTL64(x, r)		(((x) << (r)) | ((x) >> (64 - (r))))
+
+static uint64_t HashData(const uint8_t *data, uint32_t size)
+  {
+    uint64_t lane[4] = {HASH_P1 + HASH_P2, HASH_P2, 0, -HASH_P1}, h, v;
+    uint32_t i = 0, j;
+    for (; i + 32 <= size; i += 32)
+      {
+        for (j = 0; j < 4; j++)
+          {
+            memcpy(&v, &data[i + j * 8], 8);
+            lane[j] = ROTL64(lane[j] + v * HASH_P2, 31) * HASH_P1;
+          }
+      }
+    h = ROTL64(lane[0], 1) + ROTL64(lane[1], 7) + ROTL64(lane[2], 12) + ROTL64(lane[3], 18);
+    h += size;
+    for (; i < size; i++)
+      h = ROTL64(h ^ (data[i] * HASH_P3), 11) * HASH_P1;
+    h ^= h >> 33;
+    h *= HASH_P2;
+    h ^= h >> 29;
+    h *= HASH_P3;
+    return h ^ (h >> 32);
+  }
+
+
+/* true if blob holds the same bytes as request; files are only refetched
+ * when the two came from different file table entries
+ */
+static int SameContent(Rom *rom, const Blob *blob, const WriteRequest *request)
+  {
+    FileTableEntry fte;
+    int same;
+    if (blob->size != request->file.size)
+      return 0;
+    if (blob->file == request->file.index)
+      return 1;
+    if (!GetFile(rom, &fte, blob->file))
+      return 0;
+    same = fte.size == blob->size && !memcmp(fte.data, request->file.data, blob->size);
+    PutFile(rom, &fte);
+    return same;
+  }
+
+
+/* replaces path with a hardlink to the file written earlier at target */
+static int LinkOutput(Rom *rom, const char *target, const char *path)
+  {
+    Writer *writer = &rom->writer;
+    const char *name = strrchr(path, '/'), *targetName = strrchr(target, '/');
+    Directory *dir = NULL, *targetDir = NULL;
+    if (name && !(dir = GetDirectory(rom, path, name - path)))
+      return 0;
+#ifdef _WIN32
+    char full[1024], fullTarget[1024];
+    (void) targetName;
+    (void) targetDir;
+    DeleteFileA(RootPath(writer, path, full));
+    return CreateHardLinkA(full, RootPath(writer, target, fullTarget), NULL) != 0;
+#else
+    if (targetName && !(targetDir = GetDirectory(rom, target, targetName - target)))
+      return 0;
+    name = name ? name + 1 : path;
+    targetName = targetName ? targetName + 1 : target;
+    unlinkat(dir ? dir->fd : writer->rootFd, name, 0);
+    return !linkat(targetDir ? targetDir->fd : writer->rootFd, targetName,
+                   dir ? dir->fd : writer->rootFd, name, 0);
+#endif
+  }
+
+
+/* With --dedup every payload is hashed first; a file whose bytes were
+ * already written becomes a hardlink to the first copy, or in an archive an
+ * index entry sharing the first copy's payload.  Runs on the writer thread
+ * only, so the blob table needs no lock.
+ */
+static int Dedup(Rom *rom, WriteRequest *request)
+  {
+    Writer *writer = &rom->writer;
+    uint64_t hash = HashData(request->file.data, request->file.size);
+    Blob *blob, **bucket = &writer->blobs[hash & 1023];
+    int ok;
+    for (blob = *bucket; blob; blob = blob->next)
+      {
+        if (blob->hash == hash && SameContent(rom, blob, request))
+          {
+            if (writer->archive)
+              ok = ArchiveOutput(rom, request, blob->offset);
+            else if (!(ok = LinkOutput(rom, blob->path, request->path)))
+              return WriteOutput(rom, request->path, request->file.data, request->file.size);
+            if (ok)
+              {
+                writer->duplicates++;
+                writer->saved += request->file.size;
+              }
+            return ok;
+          }
+      }
+    if (writer->archive)
+      ok = ArchiveOutput(rom, request, 0);
+    else
+      ok = WriteOutput(rom, request->path, request->file.data, request->file.size);
+    if (!ok || !(blob = (Blob *) malloc(sizeof(Blob))))
+      return ok;
+    blob->hash = hash;
+    blob->size = request->file.size;
+    blob->file = request->file.index;
+    blob->offset = writer->archive ? writer->entries[writer->entryCount - 1].offset : 0;
+    blob->path = NULL;
+    if (!writer->archive && !(blob->path = strdup(request->path)))
+      {
+        free(blob);
+        return ok;
+      }
+    blob->next = *bucket;
+    *bucket = blob;
+    return ok;
+  }
+
+
+/* With --incremental the writer keeps data/.manifest, one line per file it
+ * wrote:
+ *
+ *   type table sub file vrom source size mtime path
+ *
+ * source hashes everything the file and its path are made from (the file
+ * table entry, the rom bytes it points at, its name and whatever else the
+ * extract phase passes in), size and mtime are what the output looked like
+ * right after it was written.  The next run skips an entry before even
+ * decompressing it when both still match, and removes the files of entries
+ * it didn't produce again.
+ */
+static uint64_t SourceHash(Rom *rom, int32_t index, uint32_t extra)
+  {
+    char name[MAX_NAME + 1];
+    uint32_t length = GetFileName(rom, name, index), start, end;
+    const uint8_t *entry = &rom->data[rom->fileTable.start + index * 16];
+    uint64_t h = HashData(entry, 16);
+    start = READ32(&entry[8]);
+    end = READ32(&entry[12]);
+    if (!end || end == 0xFFFFFFFF)
+      end = start + READ32(&entry[4]) - READ32(entry);
+    if (start < rom->size)
+      h = (h ^ HashData(&rom->data[start], end > start && end <= rom->size ?
+                        end - start : rom->size - start)) * HASH_P1;
+    h = (h ^ HashData((const uint8_t *) name, length)) * HASH_P2;
+    h = (h ^ extra) * HASH_P3;
+    return h ^ (h >> 29);
+  }
+
+
+/* The maps of a scene share its bucket; they are told apart by sub.  An
+ * actor's sub id is its object, which isn't known until the overlay has been
+ * decompressed, so actors are looked up by table id alone.
+ */
+static ManifestEntry **ManifestBucket(Writer *writer, int type, uint32_t table)
+  {
+    return &writer->manifest[(type * 0x9E3779B1u ^ table * 0x85EBCA77u) >> 22];
+  }
+
+
+static ManifestEntry *FindManifestEntry(Writer *writer, int type, uint32_t table, uint32_t sub)
+  {
+    ManifestEntry *entry;
+    for (entry = *ManifestBucket(writer, type, table); entry; entry = entry->next)
+      {
+        if (entry->type == type && entry->table == table && (type == ZACTOR || entry->sub == sub))
+          return entry;
+      }
+    return NULL;
+  }
+
+
+static int OutputStat(Rom *rom, const char *path, struct stat *st)
+  {
+#ifdef _WIN32
+    char full[1024];
+    return !stat(RootPath(&rom->writer, path, full), st);
+#else
+    return !fstatat(rom->writer.rootFd, path, st, 0);
+#endif
+  }
+
+
+/* True if the file for (type, table, sub) is already on disk from an
+ * earlier run.  Otherwise *source is set for WriteFile(rom).  Safe to call
+ * from any thread; each entry is only ever looked at by the task that owns
+ * it.
+ */
+static int Unchanged(Rom *rom, int type, uint32_t table, uint32_t sub, int32_t index,
+                     uint32_t extra, uint64_t *source)
+  {
+    Writer *writer = &rom->writer;
+    ManifestEntry *entry;
+    struct stat st;
+    *source = 0;
+    if (!writer->incremental)
+      return 0;
+    *source = SourceHash(rom, index, extra);
+    if (!(entry = FindManifestEntry(writer, type, table, sub)) || entry->source != *source ||
+        entry->file != index || !OutputStat(rom, entry->path, &st) ||
+        st.st_size != entry->size || st.st_mtime != entry->mtime)
+      return 0;
+    entry->state = MANIFEST_UNCHANGED;
+    return 1;
+  }
+
+
+static ManifestEntry *NewManifestEntry(const char *path)
+  {
+    ManifestEntry *entry = (ManifestEntry *) calloc(1, sizeof(ManifestEntry));
+    if (entry && !(entry->path = strdup(path)))
+      {
+        free(entry);
+        return NULL;
+      }
+    return entry;
+  }
+
+
+/* A missing or unreadable manifest just means everything gets written. */
+static void ManifestLoad(Rom *rom)
+  {
+    Writer *writer = &rom->writer;
+    ManifestEntry *entry, **bucket;
+    char line[1024], path[1024];
+    int type, table, sub, file, offset;
+    unsigned int vrom, size;
+    unsigned long long source;
+    long long mtime;
+    FILE *fp;
+    sprintf(path, "%s%s", writer->root, MANIFEST_FILE);
+    if (!(fp = fopen(path, "r")))
+      return;
+    if (!fgets(line, sizeof(line), fp) || strcmp(line, MANIFEST_HEADER))
+      {
+        fclose(fp);
+        return;
+      }
+    while (fgets(line, sizeof(line), fp))
+      {
+        line[strcspn(line, "\r\n")] = 0;
+        if (sscanf(line, "%i %i %i %i %X %llX %u %lld %n", &type, &table, &sub, &file, &vrom,
+                   &source, &size, &mtime, &offset) != 8 || !line[offset] ||
+            !(entry = NewManifestEntry(&line[offset])))
+          continue;
+        entry->type = type;
+        entry->table = table;
+        entry->sub = sub;
+        entry->file = file;
+        entry->vrom = vrom;
+        entry->source = source;
+        entry->size = size;
+        entry->mtime = mtime;
+        bucket = ManifestBucket(writer, type, table);
+        entry->next = *bucket;
+        *bucket = entry;
+      }
+    fclose(fp);
+  }
+
+
+/* runs on the writer thread once request is on disk */
+static void ManifestRecord(Rom *rom, const WriteRequest *request)
+  {
+    Writer *writer = &rom->writer;
+    ManifestEntry *entry, *old;
+    struct stat st;
+    if (writer->archive || !OutputStat(rom, request->path, &st) ||
+        !(entry = NewManifestEntry(request->path)))
+      return;
+    entry->type = request->type;
+    entry->table = request->table;
+    entry->sub = request->sub;
+    entry->file = request->file.index;
+    entry->vrom = request->file.virtual.start;
+    entry->source = request->source;
+    entry->size = st.st_size;
+    entry->mtime = st.st_mtime;
+    entry->next = writer->records;
+    writer->records = entry;
+    writer->rewritten++;
+    old = FindManifestEntry(writer, request->type, request->table, request->sub);
+    if (old)
+      old->state = strcmp(old->path, request->path) ? MANIFEST_REPLACED : MANIFEST_REWRITTEN;
+  }
+
+
+static int ComparePaths(const void *a, const void *b)
+  {
+    return strcmp(*(char **) a, *(char **) b);
+  }
+
+
+static void WriteManifestEntry(FILE *fp, const ManifestEntry *entry)
+  {
+    fprintf(fp, "%i %i %i %i %08X %016llX %u %lld %s\n", entry->type, entry->table, entry->sub,
+            entry->file, entry->vrom, (unsigned long long) entry->source, entry->size,
+            (long long) entry->mtime, entry->path);
+  }
+
+
+/* True for entries that stay in the manifest without having been written.
+ * A filtered run never looked at most of the rom, so what it didn't produce
+ * is kept rather than treated as stale.
+ */
+static int Carried(Rom *rom, const ManifestEntry *entry)
+  {
+    return entry->state == MANIFEST_UNCHANGED ||
+           (entry->state == MANIFEST_STALE && Filtered(&rom->options));
+  }
+
+
+/* Removes a file that is no longer produced, then every directory above it
+ * that this leaves empty (a scene that lost its maps, say).
+ */
+static void RemoveOutput(Writer *writer, const char *path)
+  {
+    char buffer[1024], *slash;
+    uint32_t length = strlen(path);
+    if (length >= sizeof(buffer))
+      return;
+    memcpy(buffer, path, length + 1);
+#ifdef _WIN32
+    char full[1024];
+    if (remove(RootPath(writer, buffer, full)))
+      return;
+    while ((slash = strrchr(buffer, '/')))
+      {
+        *slash = 0;
+        if (_rmdir(RootPath(writer, buffer, full)))
+          break;
+      }
+#else
+    if (unlinkat(writer->rootFd, buffer, 0))
+      return;
+    while ((slash = strrchr(buffer, '/')))
+      {
+        *slash = 0;
+        if (unlinkat(writer->rootFd, buffer, AT_REMOVEDIR))
+          break;
+      }
+#endif
+  }
+
+
+/* Writes the new manifest next to the old one and renames it over, then
+ * removes the files of stale and replaced entries unless something current
+ * has the same path (two maps of a scene can share one).  Call after
+ * WriterFlush(rom).
+ */
+static int ManifestFinish(Rom *rom)
+  {
+    Writer *writer = &rom->writer;
+    ManifestEntry *entry;
+    char path[1024], temp[1040], **live;
+    uint32_t i, count = writer->rewritten, kept = 0;
+    FILE *fp;
+    int ok;
+    sprintf(path, "%s%s", writer->root, MANIFEST_FILE);
+    sprintf(temp, "%s.new", path);
+    if (!GetDirectory(rom, "data", 4) || !(fp = fopen(temp, "w")))
+      return 0;
+    fputs(MANIFEST_HEADER, fp);
+    for (i = 0; i < 1024; i++)
+      {
+        for (entry = writer->manifest[i]; entry; entry = entry->next)
+          {
+            if (Carried(rom, entry))
+              {
+                WriteManifestEntry(fp, entry);
+                kept++;
+                writer->unchanged += entry->state == MANIFEST_UNCHANGED;
+              }
+          }
+      }
+    for (entry = writer->records; entry; entry = entry->next)
+      WriteManifestEntry(fp, entry);
+    ok = !ferror(fp);
+    ok = !fclose(fp) && ok;
+#ifdef _WIN32
+    if (ok)
+      remove(path);
+#endif
+    if (!ok || rename(temp, path))
+      {
+        remove(temp);
+        return 0;
+      }
+    count += kept;
+    if (!(live = (char **) malloc((count ? count : 1) * sizeof(char *))))
+      return 1;
+    count = 0;
+    for (entry = writer->records; entry; entry = entry->next)
+      live[count++] = entry->path;
+    for (i = 0; i < 1024; i++)
+      {
+        for (entry = writer->manifest[i]; entry; entry = entry->next)
+          {
+            if (Carried(rom, entry))
+              live[count++] = entry->path;
+          }
+      }
+    qsort(live, count, sizeof(char *), ComparePaths);
+    for (i = 0; i < 1024; i++)
+      {
+        for (entry = writer->manifest[i]; entry; entry = entry->next)
+          {
+            if (entry->state == MANIFEST_UNCHANGED || entry->state == MANIFEST_REWRITTEN ||
+                Carried(rom, entry) || bsearch(&entry->path, live, count, sizeof(char *), ComparePaths))
+              continue;
+            RemoveOutput(writer, entry->path);
+          }
+      }
+    free(live);
+    return 1;
+  }
+
+
+static THREAD_FUNC(WriterThread)
+  {
+    Rom *rom = (Rom *) arg;
+    Writer *writer = &rom->writer;
+    WriteRequest *request;
+    double time;
+    int ok;
+    MutexLock(&writer->lock);
+    for (;;)
+      {
+        while (writer->head == writer->tail && !writer->stop)
+          CondWait(&writer->wake, &writer->lock);
+        if (writer->head == writer->tail)
+          break;
+        request = &writer->requests[writer->head % WRITE_QUEUE];
+        writer->busy = 1;
+        MutexUnlock(&writer->lock);
+        time = GetTime();
+        if (writer->dedup)
+          ok = Dedup(rom, request);
+        else if (writer->archive)
+          ok = ArchiveOutput(rom, request, 0);
+        else
+          ok = WriteOutput(rom, request->path, request->file.data, request->file.size);
+        if (ok && writer->incremental)
+          ManifestRecord(rom, request);
+        rom->stats.written += ok;
+        rom->stats.writeTime += GetTime() - time;
+        PutFile(rom, &request->file);
+        MutexLock(&writer->lock);
+        if (ok && request->written)
+          (*request->written)++;
+        writer->head++;
+        writer->busy = 0;
+        CondBroadcast(&writer->wake);
+      }
+    MutexUnlock(&writer->lock);
+    return 0;
+  }
+
+
+/* Queues fte to be written to path and takes over the caller's reference to
+ * its data.  *written is bumped once the file is on disk.  type, table and
+ * sub only identify the file in the archive index and the manifest, source
+ * is the hash Unchanged(rom) computed for it.
+ */
+static void WriteFile(Rom *rom, const char *path, int type, uint32_t table, uint32_t sub,
+                      FileTableEntry *fte, uint64_t source, uint32_t *written)
+  {
+    Writer *writer = &rom->writer;
+    WriteRequest *request;
+    MutexLock(&writer->lock);
+    while (writer->tail - writer->head >= WRITE_QUEUE)
+      CondWait(&writer->wake, &writer->lock);
+    request = &writer->requests[writer->tail % WRITE_QUEUE];
+    strcpy(request->path, path);
+    request->file = *fte;
+    request->source = source;
+    request->written = written;
+    request->type = type;
+    request->table = table;
+    request->sub = sub;
+    writer->tail++;
+    CondBroadcast(&writer->wake);
+    MutexUnlock(&writer->lock);
+    fte->owner = FILE_VIEW;
+    fte->data = NULL;
+  }
+
+
+/* waits until everything queued so far has been written */
+static void WriterFlush(Rom *rom)
+  {
+    Writer *writer = &rom->writer;
+    MutexLock(&writer->lock);
+    while (writer->head != writer->tail || writer->busy)
+      CondWait(&writer->wake, &writer->lock);
+    MutexUnlock(&writer->lock);
+  }
+
+
+/* creates path and any missing parents, like mkdir -p */
+static int MakeDirectories(const char *path)
+  {
+    char buffer[512];
+    uint32_t i, length = strlen(path);
+    struct stat st;
+    if (length >= sizeof(buffer))
+      return 0;
+    memcpy(buffer, path, length + 1);
+    for (i = 1; i <= length; i++)
+      {
+        if (buffer[i] == '/' || buffer[i] == '\\' || !buffer[i])
+          {
+            buffer[i] = 0;
+            mkdir(buffer);
+            buffer[i] = path[i];
+          }
+      }
+    return !stat(path, &st) && (st.st_mode & S_IFDIR);
+  }
+
+
+static void FreeManifest(ManifestEntry *entry)
+  {
+    ManifestEntry *next;
+    for (; entry; entry = next)
+      {
+        next = entry->next;
+        free(entry->path);
+        free(entry);
+      }
+  }
+
+
+/* closes the output root and clears the writer for the next WriterStart() */
+static void WriterReset(Writer *writer)
+  {
+#ifndef _WIN32
+    if (writer->rootFd >= 0 && writer->rootFd != AT_FDCWD)
+      close(writer->rootFd);
+#endif
+    memset(writer, 0, sizeof(*writer));
+  }
+
+
+static int WriterStart(Rom *rom, const Z64Options *options)
+  {
+    Writer *writer = &rom->writer;
+    static const uint8_t header[ARCHIVE_HEADER] = {0};
+    uint32_t length;
+    memset(writer, 0, sizeof(*writer));
+    writer->dedup = options->dedup;
+    writer->incremental = options->incremental && !options->archive;
+#ifndef _WIN32
+    writer->rootFd = AT_FDCWD;
+#endif
+    if (options->output && *options->output)
+      {
+        length = strlen(options->output);
+        if (length + 2 > sizeof(writer->root) || !MakeDirectories(options->output))
+          {
+            Log(rom, "ERROR:  Failed to create '%s'\n", options->output);
+            return Z64_ERROR_OUTPUT;
+          }
+        memcpy(writer->root, options->output, length);
+        if (writer->root[length - 1] != '/')
+          writer->root[length++] = '/';
+        writer->root[length] = 0;
+#ifndef _WIN32
+        if ((writer->rootFd = open(options->output, O_RDONLY | O_DIRECTORY)) < 0)
+          {
+            Log(rom, "ERROR:  Failed to open '%s'\n", options->output);
+            return Z64_ERROR_OUTPUT;
+          }
+#endif
+      }
+    if (options->archive)
+      {
+        if (!(writer->archive = fopen(options->archive, "wb")) ||
+            !(writer->spool = tmpfile()) ||
+            (setvbuf(writer->archive, NULL, _IOFBF, 1 << 20),
+             setvbuf(writer->spool, NULL, _IOFBF, 1 << 20),
+             fwrite(header, 1, ARCHIVE_HEADER, writer->archive) != ARCHIVE_HEADER))
+          {
+            Log(rom, "ERROR:  Failed to create '%s'\n", options->archive);
+            if (writer->archive)
+              fclose(writer->archive);
+            if (writer->spool)
+              fclose(writer->spool);
+            WriterReset(writer);
+            return Z64_ERROR_OUTPUT;
+          }
+        writer->offset = ARCHIVE_HEADER;
+      }
+    if (!(writer->requests = (WriteRequest *) malloc(WRITE_QUEUE * sizeof(WriteRequest))))
+      {
+        Log(rom, "ERROR:  Failed to allocate memory\n");
+        if (writer->archive)
+          fclose(writer->archive);
+        if (writer->spool)
+          fclose(writer->spool);
+        WriterReset(writer);
+        return Z64_ERROR_MEMORY;
+      }
+    MutexInit(&writer->lock);
+    CondInit(&writer->wake);
+    if (!ThreadCreate(&writer->thread, WriterThread, rom))
+      {
+        Log(rom, "ERROR:  Failed to start the writer thread\n");
+        MutexDestroy(&writer->lock);
+        CondDestroy(&writer->wake);
+        free(writer->requests);
+        writer->requests = NULL;
+        if (writer->archive)
+          fclose(writer->archive);
+        if (writer->spool)
+          fclose(writer->spool);
+        WriterReset(writer);
+        return Z64_ERROR_THREADS;
+      }
+    if (writer->incremental)
+      ManifestLoad(rom);
+    writer->running = 1;
+    return Z64_OK;
+  }
+
+
+static void WriterStop(Rom *rom)
+  {
+    Writer *writer = &rom->writer;
+    Directory *dir;
+    Blob *blob;
+    uint32_t i;
+    if (!writer->running)
+      return;
+    MutexLock(&writer->lock);
+    writer->stop = 1;
+    CondBroadcast(&writer->wake);
+    MutexUnlock(&writer->lock);
+    ThreadJoin(writer->thread);
+    for (i = 0; i < 256; i++)
+      {
+        while (dir = writer->dirs[i])
+          {
+            writer->dirs[i] = dir->next;
+#ifndef _WIN32
+            close(dir->fd);
+#endif
+            free(dir->path);
+            free(dir);
+          }
+      }
+    for (i = 0; i < 1024; i++)
+      {
+        while (blob = writer->blobs[i])
+          {
+            writer->blobs[i] = blob->next;
+            free(blob->path);
+            free(blob);
+          }
+      }
+    for (i = 0; i < 1024; i++)
+      FreeManifest(writer->manifest[i]);
+    FreeManifest(writer->records);
+    for (i = 0; i < writer->entryCount; i++)
+      free(writer->entries[i].name);
+    free(writer->entries);
+    if (writer->archive)
+      fclose(writer->archive);
+    if (writer->spool)
+      fclose(writer->spool);
+    MutexDestroy(&writer->lock);
+    CondDestroy(&writer->wake);
+    free(writer->requests);
+    WriterReset(writer);
+  }
+
+
+/* A small work-stealing pool.  Every worker owns a queue; ParallelFor() deals
+ * out contiguous runs of indices to the queues, owners take from the front of
+ * their own queue and idle workers steal from the back of someone else's.
+ * The thread that waits on a group helps run tasks until the group is done,
+ * so with --jobs N there are N - 1 pool threads plus the caller.
+ */
+static int TakeTask(Task *task)
+  {
+    uint32_t i, q;
+    TaskQueue *queue;
+    int found = 0;
+    for (i = 0; i < pool.workers && !found; i++)
+      {
+        q = (workerId >= 0 ? workerId + i : i) % pool.workers;
+        queue = &pool.queues[q];
+        MutexLock(&queue->lock);
+        if (queue->head != queue->tail)
+          {
+            if (i == 0 && q == workerId)
+              *task = queue->tasks[queue->head++ % queue->capacity];
+            else
+              *task = queue->tasks[--queue->tail % queue->capacity];
+            found = 1;
+          }
+        MutexUnlock(&queue->lock);
+      }
+    if (found)
+      {
+        MutexLock(&pool.lock);
+        pool.queued--;
+        MutexUnlock(&pool.lock);
+      }
+    return found;
+  }
+
+
+static void RunTask(Task *task)
+  {
+    task->func(task->arg, task->index);
+    MutexLock(&pool.lock);
+    if (!--task->group->pending)
+      CondBroadcast(&pool.wake);
+    MutexUnlock(&pool.lock);
+  }
+
+
+static THREAD_FUNC(PoolWorker)
+  {
+    Task task;
+    workerId = (int) (intptr_t) arg;
+    for (;;)
+      {
+        if (TakeTask(&task))
+          {
+            RunTask(&task);
+            continue;
+          }
+        MutexLock(&pool.lock);
+        while (!pool.queued && !pool.stop)
+          CondWait(&pool.wake, &pool.lock);
+        if (pool.stop)
+          {
+            MutexUnlock(&pool.lock);
+            break;
+          }
+        MutexUnlock(&pool.lock);
+      }
+    return 0;
+  }
+
+
+static int PushTasks(uint32_t q, Task *tasks, uint32_t count)
+  {
+    TaskQueue *queue = &pool.queues[q];
+    uint32_t i, size, capacity;
+    Task *grown;
+    MutexLock(&queue->lock);
+    size = queue->tail - queue->head;
+    if (size + count > queue->capacity)
+      {
+        for (capacity = queue->capacity ? queue->capacity : 64; capacity < size + count; capacity *= 2);
+        if (!(grown = (Task *) malloc(capacity * sizeof(Task))))
+          {
+            MutexUnlock(&queue->lock);
+            return 0;
+          }
+        for (i = 0; i < size; i++)
+          grown[i] = queue->tasks[(queue->head + i) % queue->capacity];
+        free(queue->tasks);
+        queue->tasks = grown;
+        queue->capacity = capacity;
+        queue->head = 0;
+        queue->tail = size;
+      }
+    for (i = 0; i < count; i++)
+      queue->tasks[queue->tail++ % queue->capacity] = tasks[i];
+    MutexUnlock(&queue->lock);
+    MutexLock(&pool.lock);
+    pool.queued += count;
+    CondBroadcast(&pool.wake);
+    MutexUnlock(&pool.lock);
+    return 1;
+  }
+
+
+/* Runs func(arg, i) for every i below count and returns once all of them
+ * have finished.  Runs inline when the pool has no threads.
+ */
+static void ParallelFor(uint32_t count, void (*func)(void *arg, uint32_t index), void *arg)
+  {
+    TaskGroup group = {count};
+    Task task, *tasks;
+    uint32_t i, q, first, run;
+    if (!pool.workers || count < 2 || !(tasks = (Task *) malloc(count * sizeof(Task))))
+      {
+        for (i = 0; i < count; i++)
+          func(arg, i);
+        return;
+      }
+    for (i = 0; i < count; i++)
+      {
+        tasks[i].func = func;
+        tasks[i].arg = arg;
+        tasks[i].index = i;
+        tasks[i].group = &group;
+      }
+    for (q = 0, first = 0; q < pool.workers; q++, first += run)
+      {
+        run = count / pool.workers + (q < count % pool.workers);
+        if (!PushTasks((q + (workerId >= 0 ? workerId : 0)) % pool.workers, &tasks[first], run))
+          {
+            for (i = first; i < first + run; i++)
+              RunTask(&tasks[i]);
+          }
+      }
+    free(tasks);
+    for (;;)
+      {
+        if (TakeTask(&task))
+          {
+            RunTask(&task);
+            continue;
+          }
+        MutexLock(&pool.lock);
+        while (group.pending && !pool.queued)
+          CondWait(&pool.wake, &pool.lock);
+        if (!group.pending)
+          {
+            MutexUnlock(&pool.lock);
+            break;
+          }
+        MutexUnlock(&pool.lock);
+      }
+  }
+
+
+static uint32_t GetCpuCount(void)
+  {
+#ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return info.dwNumberOfProcessors;
+#else
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+    return count > 0 ? count : 1;
+#endif
+  }
+
+
+static int PoolStart(uint32_t jobs)
+  {
+    uint32_t i;
+    if (!jobs)
+      jobs = GetCpuCount();
+    if (jobs < 2)
+      return 1;
+    pool.threads = (Thread *) calloc(jobs - 1, sizeof(Thread));
+    pool.queues = (TaskQueue *) calloc(jobs - 1, sizeof(TaskQueue));
+    if (!pool.threads || !pool.queues)
+      {
+        free(pool.threads);
+        free(pool.queues);
+        return 0;
+      }
+    MutexInit(&pool.lock);
+    CondInit(&pool.wake);
+    for (i = 0; i < jobs - 1; i++)
+      MutexInit(&pool.queues[i].lock);
+    pool.workers = jobs - 1;
+    for (pool.started = 0; pool.started < pool.workers; pool.started++)
+      {
+        if (!ThreadCreate(&pool.threads[pool.started], PoolWorker, (void *) (intptr_t) pool.started))
+          {
+            PoolStop();
+            return 0;
+          }
+      }
+    return 1;
+  }
+
+
+static void PoolStop(void)
+  {
+    uint32_t i;
+    if (!pool.threads)
+      return;
+    MutexLock(&pool.lock);
+    pool.stop = 1;
+    CondBroadcast(&pool.wake);
+    MutexUnlock(&pool.lock);
+    for (i = 0; i < pool.started; i++)
+      ThreadJoin(pool.threads[i]);
+    for (i = 0; i < pool.workers; i++)
+      {
+        MutexDestroy(&pool.queues[i].lock);
+        free(pool.queues[i].tasks);
+      }
+    MutexDestroy(&pool.lock);
+    CondDestroy(&pool.wake);
+    free(pool.threads);
+    free(pool.queues);
+    memset(&pool, 0, sizeof(pool));
+  }
+
+
+/* Copies a back reference of len bytes from dist bytes behind dst.  Copies
+ * that don't overlap their own output go through memcpy; overlapping ones
+ * repeat the dist byte pattern a chunk at a time.
+ */
+static inline void yaz0copy(uint8_t *dst, uint32_t dist, uint32_t len)
+  {
+    uint32_t n;
+    if (dist == 1)
+      memset(dst, dst[-1], len);
+    else if (dist >= len)
+      memcpy(dst, dst - dist, len);
+    else
+      {
+        for (; len; len -= n, dst += n)
+          {
+            n = len < dist ? len : dist;
+            memcpy(dst, dst - dist, n);
+          }
+      }
+  }
+
+
+/* Decodes a Yaz0 stream (without its 16 byte header) into dst.  Each control
+ * byte is followed by a group of 8 literals / back references; groups that
+ * can't run off either buffer (at most 24 bytes in, 8 * 0x111 bytes out plus
+ * 8 bytes of slack) are decoded without per-op bounds checks, copying back
+ * references 8 bytes at a time when they reach at least that far back.  A
+ * final back reference that runs past dstSize is cut short, matching what the
+ * data before it would have been.
+ */
+static int yaz0dec(const uint8_t *src, uint32_t srcSize, uint8_t *dst, uint32_t dstSize)
+  {
+    Yaz0Stream stream = {src, dst, srcSize, dstSize, 0, 0};
+    return yaz0resume(&stream, dstSize);
+  }
+
+
+/* Carries on decoding a stream until at least until bytes (or all of them)
+ * are out.  It only ever stops between groups, so the positions are all the
+ * state there is and a prefix can be decoded now and the rest later.
+ */
+static int yaz0resume(Yaz0Stream *stream, uint32_t until)
+  {
+    const uint8_t *src = stream->src;
+    uint8_t *dst = stream->dst;
+    uint32_t srcSize = stream->srcSize, dstSize = stream->dstSize, srcPos = stream->srcPos;
+    uint32_t dstPos = stream->dstPos, dist, len, bit, cb;
+    if (until > dstSize)
+      until = dstSize;
+    while (dstPos < until)
+      {
+        if (srcPos >= srcSize)
+          return YAZ0_TRUNCATED;
+        cb = src[srcPos++];
+        if (srcPos + 24 <= srcSize && dstSize - dstPos >= 8 * 0x111 + 8)
+          {
+            for (bit = 0x80; bit; bit >>= 1)
+              {
+                if (cb & bit)
+                  dst[dstPos++] = src[srcPos++];
+                else
+                  {
+                    dist = (((src[srcPos] & 0x0F) << 8) | src[srcPos + 1]) + 1;
+                    len = src[srcPos] >> 4;
+                    if (len)
+                      srcPos += 2, len += 2;
+                    else
+                      len = src[srcPos + 2] + 0x12, srcPos += 3;
+                    if (dist > dstPos)
+                      return YAZ0_BAD_REFERENCE;
+                    if (dist >= 8)
+                      {
+                        uint8_t *d = &dst[dstPos], *end = d + len;
+                        for (; d < end; d += 8)
+                          memcpy(d, d - dist, 8);
+                      }
+                    else
+                      yaz0copy(&dst[dstPos], dist, len);
+                    dstPos += len;
+                  }
+              }
+          }
+        else
+          {
+            for (bit = 0x80; bit && dstPos < dstSize; bit >>= 1)
+              {
+                if (cb & bit)
+                  {
+                    if (srcPos >= srcSize)
+                      return YAZ0_TRUNCATED;
+                    dst[dstPos++] = src[srcPos++];
+                  }
+                else
+                  {
+                    if (srcPos + 2 > srcSize || (!(src[srcPos] >> 4) && srcPos + 3 > srcSize))
+                      return YAZ0_TRUNCATED;
+                    dist = (((src[srcPos] & 0x0F) << 8) | src[srcPos + 1]) + 1;
+                    len = src[srcPos] >> 4;
+                    if (len)
+                      srcPos += 2, len += 2;
+                    else
+                      len = src[srcPos + 2] + 0x12, srcPos += 3;
+                    if (dist > dstPos)
+                      return YAZ0_BAD_REFERENCE;
+                    if (len > dstSize - dstPos)
+                      len = dstSize - dstPos;
+                    yaz0copy(&dst[dstPos], dist, len);
+                    dstPos += len;
+                  }
+              }
+          }
+      }
+    stream->srcPos = srcPos;
+    stream->dstPos = dstPos;
+    return YAZ0_OK;
+  }
+
+
+/* Yaz0 encoder.  Every position is hashed on its next three bytes and
+ * chained to the previous position with the same hash, so candidates are
+ * walked newest first and the walk ends once they are out of the 4 KB
+ * window.  A match is only taken if the one starting a byte later isn't
+ * longer (one step of lazy matching, like Nintendo's encoder), which costs
+ * little and gets most of the way to an optimal parse.
+ */
+#define YAZ0_HASH_BITS		15
+#define YAZ0_WINDOW		0x1000
+#define YAZ0_MAX_MATCH		0x111
+#define YAZ0_CHAIN		64	/* candidates looked at per position */
+#define YAZ0_GOOD_MATCH		0x40	/* don't look for a longer one after this */
+
+typedef struct
+  {
+    int32_t head[1 << YAZ0_HASH_BITS];
+    int32_t prev[YAZ0_WINDOW];
+  } Yaz0Chains;
+
+
+static inline uint32_t yaz0hash(const uint8_t *p)
+  {
+    return ((p[0] << 16 | p[1] << 8 | p[2]) * 0x9E3779B1u) >> (32 - YAZ0_HASH_BITS);
+  }
+
+
+static inline void yaz0insert(Yaz0Chains *chains, const uint8_t *src, uint32_t size, uint32_t pos)
+  {
+    uint32_t h;
+    if (pos + 3 > size)
+      return;
+    h = yaz0hash(&src[pos]);
+    chains->prev[pos & (YAZ0_WINDOW - 1)] = chains->head[h];
+    chains->head[h] = pos;
+  }
+
+
+/* the longest match for pos among what has been inserted so far */
+static uint32_t yaz0match(const Yaz0Chains *chains, const uint8_t *src, uint32_t size,
+                          uint32_t pos, uint32_t *dist)
+  {
+    uint32_t len, best = 0, max = size - pos < YAZ0_MAX_MATCH ? size - pos : YAZ0_MAX_MATCH;
+    int32_t candidate, next, depth = YAZ0_CHAIN;
+    if (max < 3)
+      return 0;
+    for (candidate = chains->head[yaz0hash(&src[pos])];
+         candidate >= 0 && pos - candidate <= YAZ0_WINDOW && depth--; candidate = next)
+      {
+        if (src[candidate + best] == src[pos + best])
+          {
+            for (len = 0; len < max && src[candidate + len] == src[pos + len]; len++);
+            if (len > best)
+              {
+                best = len;
+                *dist = pos - candidate;
+                if (best >= max || best >= YAZ0_GOOD_MATCH)
+                  break;
+              }
+          }
+        if ((next = chains->prev[candidate & (YAZ0_WINDOW - 1)]) >= candidate)
+          break;
+      }
+    return best;
+  }
+
+
+/* Writes the 16 byte header and pads the output to 16 bytes; dst needs
+ * size + size / 8 + 48.  Returns the number of bytes written.
+ */
+static uint32_t yaz0enc(const uint8_t *src, uint32_t size, uint8_t *dst)
+  {
+    static THREAD_LOCAL Yaz0Chains chains;
+    uint32_t srcPos = 0, dstPos = 16, cbPos = 0, bit = 0, len = 0, dist = 0, next, nextDist = 0;
+    int pending = 0;
+    memcpy(dst, "Yaz0", 4);
+    WRITE32(&dst[4], size);
+    memset(&dst[8], 0, 8);
+    memset(chains.head, 0xFF, sizeof(chains.head));
+    while (srcPos < size)
+      {
+        if (!bit)
+          {
+            cbPos = dstPos++;
+            dst[cbPos] = 0;
+            bit = 0x80;
+          }
+        /* the match for srcPos may already be known from the lazy check */
+        if (!pending)
+          len = yaz0match(&chains, src, size, srcPos, &dist);
+        pending = 0;
+        yaz0insert(&chains, src, size, srcPos);
+        if (len >= 3 && len < YAZ0_GOOD_MATCH &&
+            (next = yaz0match(&chains, src, size, srcPos + 1, &nextDist)) > len)
+          {
+            len = next;
+            dist = nextDist;
+            pending = 1;
+          }
+        if (len < 3 || pending)
+          {
+            dst[cbPos] |= bit;
+            dst[dstPos++] = src[srcPos++];
+          }
+        else
+          {
+            if (len < 0x12)
+              dst[dstPos++] = ((len - 2) << 4) | ((dist - 1) >> 8);
+            else
+              dst[dstPos++] = (dist - 1) >> 8;
+            dst[dstPos++] = (dist - 1) & 0xFF;
+            if (len >= 0x12)
+              dst[dstPos++] = len - 0x12;
+            for (next = srcPos + len, srcPos++; srcPos < next; srcPos++)
+              yaz0insert(&chains, src, size, srcPos);
+          }
+        bit >>= 1;
+      }
+    for (; dstPos & 15; dst[dstPos++] = 0);
+    return dstPos;
+  }
+
+
+/* Reads file table entry index into fte and works out where its data is
+ * without decoding anything.  For SOURCE_YAZ0, fte->size is the size from
+ * the Yaz0 header and *srcSize the number of compressed bytes.
+ */
+static int FindFile(Rom *rom, FileTableEntry *fte, int32_t index, uint32_t *srcSize)
+  {
+    if (index < 0 || index >= rom->fileTable.size / 16)
+      return SOURCE_NONE;
+    READFTE(fte, &rom->data[rom->fileTable.start + index * 16]);
+    fte->index = index;
+    fte->data = NULL;
+    fte->owner = FILE_VIEW;
+    if (fte->virtual.end && fte->physical.end && fte->physical.start != 0xFFFFFFFF &&
+        fte->physical.end != 0xFFFFFFFF)
+      {
+        if (fte->physical.start > rom->size || rom->size - fte->physical.start < 0x10)
+          return SOURCE_NONE;
+        if (!memcmp(&rom->data[fte->physical.start], "Yaz0", 4))
+          {
+            /* a bogus physical end can't take the source past the rom */
+            *srcSize = fte->physical.end > fte->physical.start && fte->physical.end <= rom->size ?
+                       fte->physical.end - fte->physical.start : rom->size - fte->physical.start;
+            /* nor end inside the header the decoders skip */
+            if (*srcSize < 0x10)
+              return SOURCE_NONE;
+            fte->size = READ32(&rom->data[fte->physical.start + 4]);
+            return SOURCE_YAZ0;
+          }
+        fte->size = fte->virtual.end - fte->virtual.start;
+      }
+    else if (fte->virtual.end && fte->physical.start != 0xFFFFFFFF &&
+             (!fte->physical.end || (fte->physical.end && fte->physical.end != 0xFFFFFFFF &&
+             (fte->physical.end - fte->physical.start == fte->virtual.end - fte->virtual.start))))
+      fte->size = fte->virtual.end - fte->virtual.start;
+    else
+      return SOURCE_NONE;
+    if (fte->physical.start > rom->size || fte->size > rom->size - fte->physical.start)
+      return SOURCE_NONE;
+    *srcSize = fte->size;
+    return SOURCE_PLAIN;
+  }
+
+
+static int GetFile(Rom *rom, FileTableEntry *fte, int32_t index)
+  {
+    return GetFilePrefix(rom, fte, index, 0xFFFFFFFF);
+  }
+
+
+/* Like GetFile(rom), but a compressed file may only be decoded as far as the
+ * first bytes bytes; fte->size is how much of it there is so far.  Anything
+ * that only reads headers asks for a prefix and ExtendFile(rom) decodes more
+ * when it turns out to need it, picking up where the last decode stopped.
+ */
+static int GetFilePrefix(Rom *rom, FileTableEntry *fte, int32_t index, uint32_t bytes)
+  {
+    uint32_t srcSize;
+    switch (FindFile(rom, fte, index, &srcSize))
+      {
+        case SOURCE_YAZ0:
+          return CacheGet(rom, fte, &rom->data[fte->physical.start], srcSize, bytes);
+        case SOURCE_PLAIN:
+          fte->data = &rom->data[fte->physical.start];
+          return 1;
+      }
+    return 0;
+  }
+
+
+/* Makes sure at least the first bytes bytes of a file from GetFilePrefix(rom)
+ * are there (0xFFFFFFFF for the whole file).  Returns 0 if it can't decode
+ * them, in which case the file still has to be put back.
+ */
+static int ExtendFile(Rom *rom, FileTableEntry *fte, uint32_t bytes)
+  {
+    CacheEntry *entry = &rom->cache.entries[fte->index];
+    const uint8_t *src = &rom->data[fte->physical.start];
+    uint32_t srcSize;
+    if (fte->owner != FILE_CACHED || fte->size >= bytes)
+      return 1;
+    srcSize = fte->physical.end > fte->physical.start && fte->physical.end <= rom->size ?
+              fte->physical.end - fte->physical.start : rom->size - fte->physical.start;
+    MutexLock(&rom->cache.lock);
+    while (entry->state == CACHE_LOADING)
+      CondWait(&rom->cache.ready, &rom->cache.lock);
+    if (entry->state == CACHE_READY || entry->decoded >= bytes)
+      {
+        fte->size = entry->decoded;
+        MutexUnlock(&rom->cache.lock);
+        return 1;
+      }
+    if (entry->state == CACHE_FAILED)
+      {
+        MutexUnlock(&rom->cache.lock);
+        return 0;
+      }
+    return CacheDecode(rom, entry, fte, src, srcSize, bytes);
+  }
+
+
+/* Releases a file from GetFile(rom) according to who owns its data: rom views
+ * need nothing, cached files drop their reference and private copies go back
+ * to the buffer pool.
+ */
+static void PutFile(Rom *rom, FileTableEntry *fte)
+  {
+    CacheEntry *entry;
+    if (fte->owner == FILE_OWNED)
+      BufferFree(fte->data);
+    else if (fte->owner == FILE_CACHED)
+      {
+        MutexLock(&rom->cache.lock);
+        entry = &rom->cache.entries[fte->index];
+        if (!--entry->refs && entry->state == CACHE_FAILED)
+          {
+            /* a prefix was handed out before the rest turned out to be bad */
+            rom->cache.bytes -= entry->size;
+            BufferFree(entry->data);
+            entry->data = NULL;
+          }
+        else if (!entry->refs)
+          {
+            entry->prev = rom->cache.mru;
+            entry->next = NULL;
+            if (rom->cache.mru)
+              rom->cache.mru->next = entry;
+            else
+              rom->cache.lru = entry;
+            rom->cache.mru = entry;
+            CacheTrim(rom);
+          }
+        MutexUnlock(&rom->cache.lock);
+      }
+    fte->owner = FILE_VIEW;
+    fte->data = NULL;
+  }
+
+
+/* Decompressed files are cached by file number so that every compressed file
+ * is decoded at most once per run: the files LocateCodeFile(rom) classifies are
+ * extracted later, and maps can be shared by several scenes.  Entries are
+ * refcounted; unreferenced ones sit on an lru list and are dropped once the
+ * cache holds more than its budget.
+ */
+static int CacheInit(Rom *rom)
+  {
+    rom->cache.entries = (CacheEntry *) calloc(rom->fileTable.size / 16 + 1, sizeof(CacheEntry));
+    if (!rom->cache.entries)
+      return 0;
+    MutexInit(&rom->cache.lock);
+    CondInit(&rom->cache.ready);
+    return 1;
+  }
+
+
+static void CacheFree(Rom *rom)
+  {
+    uint32_t i;
+    if (!rom->cache.entries)
+      return;
+    for (i = 0; i < rom->fileTable.size / 16; i++)
+      BufferFree(rom->cache.entries[i].data);
+    free(rom->cache.entries);
+    rom->cache.entries = NULL;
+    MutexDestroy(&rom->cache.lock);
+    CondDestroy(&rom->cache.ready);
+  }
+
+
+static void CacheUnlink(Rom *rom, CacheEntry *entry)
+  {
+    if (entry->prev)
+      entry->prev->next = entry->next;
+    else
+      rom->cache.lru = entry->next;
+    if (entry->next)
+      entry->next->prev = entry->prev;
+    else
+      rom->cache.mru = entry->prev;
+    entry->prev = entry->next = NULL;
+  }
+
+
+/* call with the cache locked */
+static void CacheTrim(Rom *rom)
+  {
+    CacheEntry *entry;
+    while (rom->cache.bytes > rom->cache.budget && (entry = rom->cache.lru))
+      {
+        CacheUnlink(rom, entry);
+        rom->cache.bytes -= entry->size;
+        BufferFree(entry->data);
+        entry->data = NULL;
+        entry->decoded = entry->srcPos = 0;
+        entry->state = CACHE_EMPTY;
+      }
+  }
+
+
+/* Hands out the decompressed contents of the Yaz0 file at src, at least the
+ * first want bytes of it.  A thread that asks for a file another thread is
+ * decoding waits for it instead of decoding it again, and a file that was
+ * only decoded partway is carried on from there.  Files bigger than the
+ * whole budget bypass the rom->cache and are decoded in full.
+ */
+static int CacheGet(Rom *rom, FileTableEntry *fte, const uint8_t *src, uint32_t srcSize,
+                    uint32_t want)
+  {
+    CacheEntry *entry = &rom->cache.entries[fte->index];
+    uint32_t size = READ32(&src[4]);
+    uint8_t *data;
+    double time;
+    int ok;
+    MutexLock(&rom->cache.lock);
+    while (entry->state == CACHE_LOADING)
+      CondWait(&rom->cache.ready, &rom->cache.lock);
+    if (entry->state == CACHE_FAILED)
+      {
+        MutexUnlock(&rom->cache.lock);
+        return 0;
+      }
+    fte->owner = FILE_CACHED;
+    if (entry->state != CACHE_EMPTY)
+      {
+        if (!entry->refs++)
+          CacheUnlink(rom, entry);
+        if (entry->state == CACHE_READY || entry->decoded >= want)
+          {
+            rom->cache.hits++;
+            fte->data = entry->data;
+            fte->size = entry->decoded;
+            MutexUnlock(&rom->cache.lock);
+            return 1;
+          }
+      }
+    else if (size <= rom->cache.budget)
+      {
+        entry->refs = 1;
+        entry->size = size;
+        rom->cache.misses++;
+      }
+    else
+      {
+        rom->cache.misses++;
+        MutexUnlock(&rom->cache.lock);
+        time = GetTime();
+        data = BufferAlloc(size);
+        ok = data && yaz0dec(&src[0x10], srcSize - 0x10, data, size) == YAZ0_OK;
+        time = GetTime() - time;
+        MutexLock(&rom->cache.lock);
+        rom->stats.decoded += ok;
+        rom->stats.decodedIn += ok ? srcSize : 0;
+        rom->stats.decodedOut += ok ? size : 0;
+        rom->stats.decodeTime += time;
+        MutexUnlock(&rom->cache.lock);
+        fte->owner = FILE_OWNED;
+        fte->data = data;
+        fte->size = size;
+        if (!ok)
+          PutFile(rom, fte);
+        return ok;
+      }
+    if (!CacheDecode(rom, entry, fte, src, srcSize, want))
+      {
+        PutFile(rom, fte);
+        return 0;
+      }
+    return 1;
+  }
+
+
+/* Decodes entry up to want bytes, starting it off if it's empty.  Called
+ * with the cache locked and a reference held, returns with it unlocked.
+ * The entry is marked as loading meanwhile, but only the bytes past what
+ * was decoded before are written, so prefixes already handed out stay put.
+ */
+static int CacheDecode(Rom *rom, CacheEntry *entry, FileTableEntry *fte, const uint8_t *src,
+                       uint32_t srcSize, uint32_t want)
+  {
+    Yaz0Stream stream;
+    uint8_t state = entry->state;
+    double time;
+    int ok;
+    entry->state = CACHE_LOADING;
+    MutexUnlock(&rom->cache.lock);
+    time = GetTime();
+    if (state == CACHE_EMPTY)
+      entry->data = BufferAlloc(entry->size);
+    stream.src = &src[0x10];
+    stream.dst = entry->data;
+    stream.srcSize = srcSize - 0x10;
+    stream.dstSize = entry->size;
+    stream.srcPos = entry->srcPos;
+    stream.dstPos = entry->decoded;
+    /* a little past what was asked for, headers are rarely read just once */
+    want = want < entry->size && entry->size - want > 0x100 ? (want + 0x100) & ~0xFF : entry->size;
+    ok = entry->data && yaz0resume(&stream, want) == YAZ0_OK;
+    time = GetTime() - time;
+    MutexLock(&rom->cache.lock);
+    rom->stats.decodeTime += time;
+    if (!entry->data)
+      {
+        /* nothing to put back */
+        entry->refs = 0;
+        entry->state = CACHE_EMPTY;
+        fte->owner = FILE_VIEW;
+        fte->data = NULL;
+      }
+    else if (state == CACHE_EMPTY)
+      {
+        rom->cache.bytes += entry->size;
+        if (rom->cache.bytes > rom->cache.peak)
+          rom->cache.peak = rom->cache.bytes;
+      }
+    if (entry->data && !ok)
+      entry->state = CACHE_FAILED;
+    else if (ok)
+      {
+        rom->stats.decodedIn += state == CACHE_EMPTY ? 0x10 : 0;
+        rom->stats.decodedIn += stream.srcPos - entry->srcPos;
+        rom->stats.decodedOut += stream.dstPos - entry->decoded;
+        entry->srcPos = stream.srcPos;
+        entry->decoded = stream.dstPos;
+        entry->state = entry->decoded == entry->size ? CACHE_READY : CACHE_PARTIAL;
+        rom->stats.decoded += entry->state == CACHE_READY;
+        fte->data = entry->data;
+        fte->size = entry->decoded;
+        CacheTrim(rom);
+      }
+    CondBroadcast(&rom->cache.ready);
+    MutexUnlock(&rom->cache.lock);
+    return ok;
+  }
+
+
+/* Decompression buffers come from power of two size classes (4 KB - 16 MB)
+ * shared by all threads.  Freed buffers are kept on a per class free list for
+ * the next file of a similar size, up to POOL_RETAIN bytes in total, so a
+ * dump reuses a handful of buffers instead of a malloc/free per file and the
+ * memory held stays bounded.  Anything bigger than the largest class is
+ * malloc'd directly.
+ */
+static void BufferPoolInit(void)
+  {
+    MutexInit(&buffers.lock);
+  }
+
+
+static void BufferPoolFree(void)
+  {
+    PoolBuffer *buffer;
+    int c;
+    for (c = 0; c < POOL_CLASSES; c++)
+      {
+        while (buffer = buffers.free[c])
+          {
+            buffers.free[c] = buffer->next;
+            free(buffer);
+          }
+      }
+    buffers.retained = 0;
+    MutexDestroy(&buffers.lock);
+  }
+
+
+static uint8_t *BufferAlloc(uint32_t size)
+  {
+    PoolBuffer *buffer = NULL;
+    uint32_t capacity;
+    uint8_t c;
+    for (c = 0; c < POOL_CLASSES && (1u << (c + POOL_MIN_SHIFT)) < size; c++);
+    capacity = c < POOL_CLASSES ? 1u << (c + POOL_MIN_SHIFT) : size;
+    MutexLock(&buffers.lock);
+    buffers.requests++;
+    if (c < POOL_CLASSES && (buffer = buffers.free[c]))
+      {
+        buffers.free[c] = buffer->next;
+        buffers.retained -= capacity;
+        buffers.reuses++;
+      }
+    else
+      buffers.mallocs++;
+    buffers.inUse += capacity;
+    if (buffers.inUse > buffers.peak)
+      buffers.peak = buffers.inUse;
+    MutexUnlock(&buffers.lock);
+    if (!buffer && (buffer = (PoolBuffer *) malloc(POOL_HEADER + capacity)))
+      {
+        buffer->size = capacity;
+        buffer->sizeClass = c;
+      }
+    else if (!buffer)
+      {
+        MutexLock(&buffers.lock);
+        buffers.inUse -= capacity;
+        MutexUnlock(&buffers.lock);
+        return NULL;
+      }
+    return (uint8_t *) buffer + POOL_HEADER;
+  }
+
+
+static void BufferFree(uint8_t *data)
+  {
+    PoolBuffer *buffer;
+    if (!data)
+      return;
+    buffer = (PoolBuffer *) (data - POOL_HEADER);
+    MutexLock(&buffers.lock);
+    buffers.inUse -= buffer->size;
+    if (buffer->sizeClass < POOL_CLASSES && buffers.retained + buffer->size <= POOL_RETAIN)
+      {
+        buffer->next = buffers.free[buffer->sizeClass];
+        buffers.free[buffer->sizeClass] = buffer;
+        buffers.retained += buffer->size;
+        buffer = NULL;
+      }
+    else
+      buffers.releases++;
+    MutexUnlock(&buffers.lock);
+    free(buffer);
+  }
+
+
+static int GetFileNumber(Rom *rom, uint32_t start, uint32_t end)
+  {
+    uint32_t lo = 0, hi = rom->fileTable.size / 16, mid;
+    while (lo < hi)
+      {
+        mid = lo + (hi - lo) / 2;
+        if (rom->vromIndex[mid].start < start)
+          lo = mid + 1;
+        else
+          hi = mid;
+      }
+    for (; lo < rom->fileTable.size / 16 && rom->vromIndex[lo].start == start; lo++)
+      {
+        if (!end || rom->vromIndex[lo].end == end)
+          return rom->vromIndex[lo].index;
+      }
+    return -1;
+  }
+
+
+/* Writes the name of the file to buffer and returns its length.  Names are
+ * clamped to MAX_NAME characters so they always fit in the path buffers.
+ */
+static uint32_t GetFileName(Rom *rom, char *buffer, int32_t index)
+  {
+    uint32_t length;
+    FileTableEntry fte;
+    if (index < 0 || index >= rom->fileTable.size / 16)
+      {
+        *buffer = 0;
+        return 0;
+      }
+    if (rom->fileNames)
+      {
+        length = rom->fileNames[index].length < MAX_NAME ? rom->fileNames[index].length : MAX_NAME;
+        memcpy(buffer, &rom->data[rom->fileNames[index].offset], length);
+        buffer[length] = 0;
+        return length;
+      }
+    READFTE(&fte, &rom->data[rom->fileTable.start + index * 16]);
+    return sprintf(buffer, "%08X - %08X", fte.virtual.start, fte.virtual.end);
+  }
+
+
+/* The cheap checks go first: the codesig and an actor's relocation trailer
+ * at the end, then the header commands at the start.  Only a file that is
+ * none of those is searched, for the end of a display list that makes it
+ * an object.
+ */
+static int GetFileType(const uint8_t *data, uint32_t size)
+  {
+    const uint8_t codesig[] =
+      {
+        0x18, 0xF9, 0x6A, 0x6E, 0xB8, 0xE3, 0x82, 0x76,
+        0x47, 0x1D, 0x18, 0xF9, 0x82, 0x76, 0x6A, 0x6E,
+        0x6A, 0x6E, 0x82, 0x76, 0xE7, 0x07, 0xB8, 0xE3,
+        0x7D, 0x8A, 0x47, 0x1D, 0x6A, 0x6E, 0x18, 0xF9
+      };
+    const uint8_t *p, *end = data + (size & ~7);
+    int type;
+    if (size < 8)
+      return ZDATA;
+    if (size > 32 && !memcmp(&data[size - 32], codesig, 32))
+      return ZASM;
+    uint32_t tlen = READ32(&data[size - 4]);
+    if (tlen >= 0x18 && tlen < size)
       {
         uint32_t table = size - tlen;
         uint32_t textSize = READ32(&data[table]);
@@ -894,25 +5865,1123 @@ static int GetFileType(uint8_t *data, uint32_t size)
         if ((actorSize - (actorSize % 0x10)) == size)
           return ZACTOR;
       }
-    uint32_t i, flags = 0, w0, w1;
-    for (i = 0; i < size && i < size; i += 8)
+    if ((type = GetHeaderType(data, size)) != ZDATA)
+      return type;
+    /* memchr() skips ahead to the candidates, only aligned ones count */
+    for (p = data; p < end && (p = (const uint8_t *) memchr(p, 0xDF, end - p)); p++)
+      {
+        if (!((p - data) & 7) && READ32(p) == 0xDF000000 && !READ32(p + 4))
+          return ZOBJ;
+      }
+    return ZDATA;
+  }
+
+
+/* The part of GetFileType() that only needs the start of a file: the scene
+ * and map header commands, which end within the first SCENE_HEADER bytes.
+ * ZDATA means it can't tell (an object's display list end can come first)
+ * and the whole file has to be looked at.  Code and actor overlays never
+ * start with an end marker command, so checking this before their
+ * trailers doesn't change the answer.
+ */
+static int GetHeaderType(const uint8_t *data, uint32_t size)
+  {
+    uint32_t i, flags = 0, w0, w1;
+    for (i = 0; i + 8 <= size && i < SCENE_HEADER; i += 8)
+      {
+        w0 = READ32(&data[i]);
+        w1 = READ32(&data[i + 4]);
+        if (w0 == 0x14000000 && !w1)
+          {
+            if (flags & 0x80000000 && !(flags & ~0xE0000000))
+              return ZSCENE;
+            return ZMAP;
+          }
+        else if (data[i] == 0x04)
+          flags |= 0x80000000;
+        else if ((data[i] == 0x05 && !w1) || data[i] == 0x06)
+          flags |= 0x40000000;
+        else if (data[i] == 0x01)
+          flags |= 0x20000000;
+        else if (w0 == 0xDF000000 && !w1)
+          break;
+      }
+    return ZDATA;
+  }
+
+
+#ifndef Z64DUMP_LIBRARY
+/* The original decoder, kept as the reference for the benchmark.  It has no
+ * bounds checks, so it's only ever fed streams known to be good.
+ */
+static void yaz0decReference(uint8_t *src, uint8_t *dst, uint32_t size)
+  {
+    uint32_t srcPos = 0, dstPos = 0, cpyPos, cpyLen, vb = 1, cb = 0;
+    while (dstPos < size)
+      {
+        if (cb <<= 1, vb--, !vb)
+          {
+            cb = src[srcPos++];
+            vb = 8;
+          }
+        if (cb & 0x80)
+          dst[dstPos++] = src[srcPos++];
+        else
+          {
+            cpyLen = src[srcPos++];
+            cpyPos = dstPos - (((cpyLen & 0x0F) << 8) | src[srcPos++]) - 1;
+            cpyLen = cpyLen >> 4 ? (cpyLen >> 4) + 2 : src[srcPos++] + 0x12;
+            for(; cpyLen; cpyLen--)
+              dst[dstPos++] = dst[cpyPos++];
+          }
+      }
+  }
+
+
+static void BenchmarkByteswap(const char *name, void (*swap)(uint8_t *, uint32_t),
+                              uint8_t *data, uint32_t size, const uint8_t *expect)
+  {
+    const int passes = 8;
+    int i;
+    double t = GetTime();
+    for (i = 0; i < passes; i++)
+      swap(data, size);
+    t = GetTime() - t;
+    /* an even number of passes leaves the buffer as it started */
+    swap(data, size);
+    printf("  %-24s %8.1f MB/s  %s\n", name, (double) size * passes / t / 1048576.0,
+           memcmp(data, expect, size) ? "MISMATCH" : "ok");
+    swap(data, size);
+  }
+
+
+/* Builds a valid Yaz0 stream of size bytes from random ops.  literal is the
+ * chance (out of 256) of an op being a literal, and back references are
+ * maxLen bytes at most and reach at most maxDist bytes back.
+ */
+static uint8_t *MakeYaz0Stream(uint32_t size, uint32_t literal, uint32_t maxLen, uint32_t maxDist,
+                               uint32_t *srcSize)
+  {
+    uint8_t *src = (uint8_t *) malloc(size * 9 / 8 + 16);
+    uint32_t srcPos = 0, dstPos = 0, cbPos = 0, bit = 0, len, dist, seed = 0xC0FFEE;
+    if (!src)
+      return NULL;
+    while (dstPos < size)
+      {
+        if (!bit)
+          {
+            cbPos = srcPos++;
+            src[cbPos] = 0;
+            bit = 0x80;
+          }
+        seed = seed * 1103515245 + 12345;
+        len = 3 + ((seed >> 8) % (maxLen - 2));
+        dist = 1 + ((seed >> 3) % maxDist);
+        if (((seed >> 24) & 0xFF) < literal || dist > dstPos || len > size - dstPos)
+          {
+            src[cbPos] |= bit;
+            src[srcPos++] = 'A' + ((seed >> 16) & 0x0F);
+            dstPos++;
+          }
+        else
+          {
+            dist--;
+            if (len < 0x12)
+              src[srcPos++] = ((len - 2) << 4) | (dist >> 8);
+            else
+              src[srcPos++] = dist >> 8;
+            src[srcPos++] = dist & 0xFF;
+            if (len >= 0x12)
+              src[srcPos++] = len - 0x12;
+            dstPos += len;
+          }
+        bit >>= 1;
+      }
+    *srcSize = srcPos;
+    return src;
+  }
+
+
+static void BenchmarkYaz0(const char *name, uint32_t literal, uint32_t maxLen, uint32_t maxDist)
+  {
+    const uint32_t size = 16 << 20;
+    const int passes = 4;
+    uint32_t srcSize;
+    uint8_t *src = MakeYaz0Stream(size, literal, maxLen, maxDist, &srcSize);
+    uint8_t *expect = (uint8_t *) malloc(size), *dst = (uint8_t *) malloc(size + size / 8 + 48);
+    uint32_t packed;
+    double t, ref, enc;
+    int i, ok = 1;
+    if (src && expect && dst)
+      {
+        t = GetTime();
+        for (i = 0; i < passes; i++)
+          yaz0decReference(src, expect, size);
+        ref = GetTime() - t;
+        t = GetTime();
+        for (i = 0; i < passes; i++)
+          ok &= yaz0dec(src, srcSize, dst, size) == YAZ0_OK;
+        t = GetTime() - t;
+        ok &= !memcmp(dst, expect, size);
+        /* the encoder is timed on what was just decoded, and has to give it back */
+        enc = GetTime();
+        packed = yaz0enc(expect, size, dst);
+        enc = GetTime() - enc;
+        ok &= yaz0dec(&dst[16], packed - 16, src, size) == YAZ0_OK && !memcmp(src, expect, size);
+        printf("  %-24s %3i%% ratio  reference %7.1f MB/s  yaz0dec %7.1f MB/s  "
+               "yaz0enc %6.1f MB/s %3i%%  %s\n", name, (int) ((uint64_t) srcSize * 100 / size),
+               (double) size * passes / ref / 1048576.0, (double) size * passes / t / 1048576.0,
+               (double) size / enc / 1048576.0, (int) ((uint64_t) packed * 100 / size),
+               ok ? "ok" : "MISMATCH");
+      }
+    free(src);
+    free(expect);
+    free(dst);
+  }
+
+
+static void Benchmark(void)
+  {
+    const uint32_t size = 64 << 20;
+    uint8_t *data = (uint8_t *) malloc(size), *expect16 = (uint8_t *) malloc(size),
+            *expect32 = (uint8_t *) malloc(size);
+    uint32_t i, seed = 0x12345678;
+    int k;
+    char name[64];
+    if (!data || !expect16 || !expect32)
+      {
+        printf("ERROR:  Failed to allocate memory\n");
+        free(data);
+        free(expect16);
+        free(expect32);
+        return;
+      }
+    for (i = 0; i < size; i++)
+      {
+        seed = seed * 1103515245 + 12345;
+        data[i] = seed >> 16;
+      }
+    memcpy(expect16, data, size);
+    ByteswapReference16(expect16, size);
+    memcpy(expect32, data, size);
+    ByteswapReference32(expect32, size);
+    printf("byteswap (%i MB, selected kernel: %s)\n", size >> 20, GetByteswapKernel()->name);
+    BenchmarkByteswap("reference middle endian", ByteswapReference16, data, size, expect16);
+    BenchmarkByteswap("reference little endian", ByteswapReference32, data, size, expect32);
+    for (k = 0; k < sizeof(byteswapKernels) / sizeof(byteswapKernels[0]); k++)
+      {
+        if (!byteswapKernels[k].supported())
+          continue;
+        sprintf(name, "%s middle endian", byteswapKernels[k].name);
+        BenchmarkByteswap(name, byteswapKernels[k].swap16, data, size, expect16);
+        sprintf(name, "%s little endian", byteswapKernels[k].name);
+        BenchmarkByteswap(name, byteswapKernels[k].swap32, data, size, expect32);
+      }
+    free(data);
+    free(expect16);
+    free(expect32);
+    printf("yaz0 (16 MB decompressed per stream)\n");
+    BenchmarkYaz0("literal heavy", 160, 0x12, 0x1000);
+    BenchmarkYaz0("short matches", 64, 0x12, 0x400);
+    BenchmarkYaz0("long matches", 32, 0x111, 0x1000);
+    BenchmarkYaz0("runs", 32, 0x111, 4);
+  }
+
+
+/* Synthetic roms for --make-rom and --benchmark-roms.  They have the shape
+ * the locate stages look for rather than real content: a dmadata table
+ * starting with the makerom and boot entries, a makerom name table in boot,
+ * a code file ending in the codesig with scene, object and actor tables
+ * between 0xFF fences, and Yaz0 compressed scenes (with map lists), maps,
+ * actor overlays (with a relocation trailer and init info) and objects
+ * (with an end display list).  Payloads are random literals mixed with
+ * back references so they compress about as well as real files.
+ */
+static void SyntheticDefaults(SyntheticSpec *spec, int mm)
+  {
+    spec->mm = mm;
+    spec->order = 0;
+    spec->scenes = mm ? 113 : 110;
+    spec->maps = mm ? 5 : 6;
+    spec->actors = mm ? 690 : 470;
+    spec->objects = mm ? 640 : 400;
+    spec->misc = mm ? 30 : 28;
+    spec->size = 16 << 10;
+    spec->code = 1 << 20;
+    spec->seed = 1;
+  }
+
+
+/* oot or mm, then any of scenes=, maps= (per scene), actors=, objects=,
+ * misc= (files before code), size= (average payload), code= (bytes),
+ * seed= and order=z64|n64|v64, comma separated
+ */
+static int ParseSynthetic(SyntheticSpec *spec, const char *text)
+  {
+    static const char *keys[] = {"scenes", "maps", "actors", "objects", "misc", "size", "code",
+                                 "seed"};
+    uint32_t *values[] = {&spec->scenes, &spec->maps, &spec->actors, &spec->objects, &spec->misc,
+                          &spec->size, &spec->code, &spec->seed};
+    uint32_t i, length;
+    char *end;
+    SyntheticDefaults(spec, !strncmp(text, "mm", 2) && (!text[2] || text[2] == ','));
+    for (; *text; text += length + (text[length] == ','))
+      {
+        length = strcspn(text, ",");
+        if ((length == 3 && !strncmp(text, "oot", 3)) || (length == 2 && !strncmp(text, "mm", 2)))
+          continue;
+        if (!strncmp(text, "order=", 6))
+          {
+            for (i = 0; i < 3 && strncmp(&text[6], &"z64n64v64"[i * 3], 3); i++);
+            if (i == 3 || length != 9)
+              return 0;
+            spec->order = i;
+            continue;
+          }
+        for (i = 0; i < 8; i++)
+          {
+            if (!strncmp(text, keys[i], strlen(keys[i])) && text[strlen(keys[i])] == '=')
+              break;
+          }
+        if (i == 8)
+          return 0;
+        *values[i] = strtoul(&text[strlen(keys[i]) + 1], &end, 0);
+        if (end != text + length)
+          return 0;
+      }
+    for (i = 0; i < 5; i++)
+      {
+        if (*values[i] > 0x10000)
+          return 0;
+      }
+    /* a scene has up to 2 * maps - 1 maps; BuildSyntheticRom() sizes for 2 * maps */
+    if (4 + spec->misc + (uint64_t) spec->scenes * 2 * spec->maps + spec->actors + spec->objects >
+        0x100000)
+      return 0;
+    return spec->scenes >= 3 && spec->actors >= 3 && spec->objects >= 3 && spec->maps &&
+           spec->size >= 0x100 && spec->size <= (16 << 20) && spec->code <= (16 << 20);
+  }
+
+
+static uint32_t SyntheticRandom(uint32_t *seed)
+  {
+    *seed ^= *seed << 13;
+    *seed ^= *seed >> 17;
+    *seed ^= *seed << 5;
+    return *seed;
+  }
+
+
+/* random literals and back references, roughly 2:1 compressible */
+static void SyntheticFill(uint8_t *data, uint32_t size, uint32_t *seed)
+  {
+    uint32_t i = 0, r, len, dist;
+    while (i < size)
+      {
+        r = SyntheticRandom(seed);
+        len = 3 + (r >> 8) % 40;
+        dist = 1 + (r >> 16) % 0x1000;
+        if ((r & 3) == 0 || dist > i)
+          {
+            for (len = 1 + (r >> 4) % 8; len && i < size; len--)
+              data[i++] = SyntheticRandom(seed) >> 24;
+          }
+        else
+          {
+            for (; len && i < size; len--, i++)
+              data[i] = data[i - dist];
+          }
+      }
+  }
+
+
+enum
+  {
+    SYNTHETIC_MISC,
+    SYNTHETIC_CODE,
+    SYNTHETIC_SCENE,
+    SYNTHETIC_MAP,
+    SYNTHETIC_ACTOR,
+    SYNTHETIC_OBJECT
+  };
+
+
+/* sub is the first map of a scene or the init info offset of an actor */
+typedef struct
+  {
+    uint32_t vrom, size, id, sub, count;
+    uint8_t kind;
+  } SyntheticFile;
+
+
+/* code's tables, each between 0xFF fences: scenes, objects (0 is empty),
+ * then actors with every sixteenth entry empty
+ */
+static void SyntheticTables(const SyntheticSpec *spec, const SyntheticFile *files, uint32_t count,
+                            uint8_t *p)
+  {
+    uint32_t f, n, steSize = spec->mm ? 0x10 : 0x14;
+    memset(p, 0xFF, 64);
+    for (p += 64, f = 0; f < count; f++)
+      {
+        if (files[f].kind != SYNTHETIC_SCENE)
+          continue;
+        memset(p, 0, steSize);
+        WRITE32(&p[0], files[f].vrom);
+        WRITE32(&p[4], files[f].vrom + files[f].size);
+        p += steSize;
+      }
+    memset(p, 0xFF, 64);
+    memset(p + 64, 0, 8);
+    for (p += 72, f = 0; f < count; f++)
       {
-        w0 = READ32(&data[i]);
-        w1 = READ32(&data[i + 4]);
-        if (i < 0x100 && w0 == 0x14000000 && !w1)
+        if (files[f].kind != SYNTHETIC_OBJECT)
+          continue;
+        WRITE32(&p[0], files[f].vrom);
+        WRITE32(&p[4], files[f].vrom + files[f].size);
+        p += 8;
+      }
+    memset(p, 0xFF, 64);
+    for (p += 64, f = 0, n = 0; n < spec->actors; n++, p += 32)
+      {
+        memset(p, 0, 32);
+        if (n % 16 == 15)
+          continue;
+        while (files[f].kind != SYNTHETIC_ACTOR)
+          f++;
+        WRITE32(&p[0], files[f].vrom);
+        WRITE32(&p[4], files[f].vrom + files[f].size);
+        WRITE32(&p[8], 0x80800000 + n * 0x10000);
+        WRITE32(&p[12], 0x80800000 + n * 0x10000 + files[f].size);
+        WRITE32(&p[20], 0x80800000 + n * 0x10000 + files[f].sub);
+        f++;
+      }
+    memset(p, 0xFF, 64);
+  }
+
+
+/* actor overlays end in a relocation table whose sizes add up to the file */
+static uint32_t SyntheticRelocSize(uint32_t size)
+  {
+    uint32_t tlen, relocs = size / 256;
+    for (tlen = (24 + relocs * 4 + 15) & ~15; tlen < 0x28 + relocs * 4; tlen += 16);
+    return tlen;
+  }
+
+
+static void SyntheticContent(const SyntheticSpec *spec, const SyntheticFile *files, uint32_t count,
+                             uint32_t f, uint8_t *data, uint32_t *seed)
+  {
+    static const uint8_t codesig[] =
+      {
+        0x18, 0xF9, 0x6A, 0x6E, 0xB8, 0xE3, 0x82, 0x76,
+        0x47, 0x1D, 0x18, 0xF9, 0x82, 0x76, 0x6A, 0x6E,
+        0x6A, 0x6E, 0x82, 0x76, 0xE7, 0x07, 0xB8, 0xE3,
+        0x7D, 0x8A, 0x47, 0x1D, 0x6A, 0x6E, 0x18, 0xF9
+      };
+    const SyntheticFile *file = &files[f], *map;
+    uint32_t k, tlen, relocs, text, size = file->size;
+    uint8_t *p;
+    SyntheticFill(data, size, seed);
+    /* nothing but actors and code may end in a nonzero word */
+    memset(&data[size - 4], 0, 4);
+    switch (file->kind)
+      {
+        case SYNTHETIC_MAP:
+          memcpy(data, "\x14\0\0\0\0\0\0\0", 8);
+          break;
+        case SYNTHETIC_SCENE:
+          /* a map list command and the end marker, then the list */
+          memcpy(data, "\x04\0\0\0\x02\0\0\x10\x14\0\0\0\0\0\0\0", 16);
+          data[1] = file->count;
+          for (k = 0; k < file->count; k++)
+            {
+              map = &files[file->sub + k];
+              WRITE32(&data[16 + k * 8], map->vrom);
+              WRITE32(&data[20 + k * 8], map->vrom + map->size);
+            }
+          break;
+        case SYNTHETIC_ACTOR:
+          tlen = SyntheticRelocSize(size);
+          relocs = size / 256;
+          text = size - tlen;
+          p = &data[text];
+          memset(p, 0, tlen);
+          WRITE32(&p[0], text);
+          WRITE32(&p[12], tlen - 0x28 - relocs * 4);
+          WRITE32(&p[16], relocs);
+          for (k = 0; k < relocs; k++)
+            WRITE32(&p[20 + k * 4], 0x45000000 | (k * 4 % text));
+          WRITE32(&data[size - 4], tlen);
+          data[file->sub + 2] = file->id % 12;
+          WRITE16(&data[file->sub + 8], 1 + file->id % (spec->objects - 1));
+          break;
+        case SYNTHETIC_OBJECT:
+          memset(data, 0, 16);
+          memcpy(&data[16], "\xDF\0\0\0\0\0\0\0", 8);
+          break;
+        case SYNTHETIC_CODE:
+          /* code's count is the room its tables take */
+          SyntheticTables(spec, files, count, &data[(size - file->count) * 3 / 4 & ~15]);
+          memcpy(&data[size - 32], codesig, 32);
+          break;
+      }
+  }
+
+
+static uint32_t SyntheticName(const SyntheticFile *file, uint32_t index, char *name)
+  {
+    static const char *boot[] = {"makerom", "boot", "dmadata"};
+    switch (file->kind)
+      {
+        case SYNTHETIC_CODE:
+          return sprintf(name, "code");
+        case SYNTHETIC_SCENE:
+          return sprintf(name, "scene%03u_scene", file->id);
+        case SYNTHETIC_MAP:
+          return sprintf(name, "scene%03u_room_%u", file->id, file->sub);
+        case SYNTHETIC_ACTOR:
+          return sprintf(name, "ovl_actor_%03u", file->id);
+        case SYNTHETIC_OBJECT:
+          return sprintf(name, "object_%03u", file->id);
+        default:
+          if (index < 3)
+            return sprintf(name, "%s", boot[index]);
+          return sprintf(name, "misc_%u", file->id);
+      }
+  }
+
+
+/* Lays out the files (makerom, boot, dmadata, misc, code, then every scene
+ * followed by its maps, actor overlays and objects) and builds the whole
+ * image in memory.  Returns NULL if it can't be allocated.
+ */
+static uint8_t *BuildSyntheticRom(const SyntheticSpec *spec, uint32_t *romSize, uint32_t *fileCount)
+  {
+    SyntheticFile *files;
+    uint32_t count, i, k, n, f, phys, size, largest = 0, dma, seed = spec->seed | 1;
+    uint64_t capacity, vrom;
+    uint8_t *rom = NULL, *raw = NULL, *names;
+    count = 4 + spec->misc + spec->scenes * 2 * spec->maps + spec->actors + spec->objects;
+    if (!(files = (SyntheticFile *) calloc(count, sizeof(SyntheticFile))))
+      return NULL;
+    for (f = 3, i = 0; i < spec->misc; i++, f++)
+      files[f].id = i;
+    files[f++].kind = SYNTHETIC_CODE;
+    for (i = 0; i < spec->scenes; i++)
+      {
+        files[f].kind = SYNTHETIC_SCENE;
+        files[f].id = i;
+        files[f].sub = f + 1;
+        files[f].count = n = 1 + SyntheticRandom(&seed) % (2 * spec->maps - 1);
+        for (k = 0, f++; k < n; k++, f++)
           {
-            if (flags & 0x80000000 && !(flags & ~0xE0000000))
-              return ZSCENE;
-            return ZMAP;
+            files[f].kind = SYNTHETIC_MAP;
+            files[f].id = i;
+            files[f].sub = k;
           }
-        else if (data[i] == 0x04)
-          flags |= 0x80000000;
-        else if ((data[i] == 0x05 && !w1) || data[i] == 0x06)
-          flags |= 0x40000000;
-        else if (data[i] == 0x01)
-          flags |= 0x20000000;
-        else if (w0 == 0xDF000000 && !w1)
-          return ZOBJ;
       }
-    return ZDATA;
+    for (i = 0; i < spec->actors; i++)
+      {
+        if (i % 16 != 15)
+          files[f].kind = SYNTHETIC_ACTOR, files[f++].id = i;
+      }
+    for (i = 1; i < spec->objects; i++, f++)
+      files[f].kind = SYNTHETIC_OBJECT, files[f].id = i;
+    count = f;
+    /* boot is 4 KB of nothing followed by the name table */
+    files[0].size = 0x1060;
+    files[1].size = 0x1000 + count * 32;
+    files[2].size = count * 16;
+    for (f = 3; f < count; f++)
+      {
+        size = spec->size / 2 + SyntheticRandom(&seed) % spec->size;
+        if (files[f].kind == SYNTHETIC_CODE)
+          {
+            files[f].count = 64 * 4 + spec->scenes * (spec->mm ? 0x10 : 0x14) + spec->objects * 8 +
+                             spec->actors * 32;
+            size = spec->code + files[f].count + 0x200;
+          }
+        else if (files[f].kind == SYNTHETIC_SCENE && size < 48 + files[f].count * 8)
+          size = 48 + files[f].count * 8;
+        files[f].size = (size + 15) & ~15;
+        largest = files[f].size > largest ? files[f].size : largest;
+        if (files[f].kind == SYNTHETIC_ACTOR)
+          files[f].sub = (files[f].size - SyntheticRelocSize(files[f].size)) / 2 & ~15;
+      }
+    for (vrom = 0, f = 0; f < count; f++)
+      {
+        files[f].vrom = vrom;
+        vrom += files[f].size;
+      }
+    capacity = vrom + vrom / 8 + count * 48 + (1 << 20);
+    if (capacity > 0xFFFFFFFF || !(rom = (uint8_t *) calloc(1, capacity)) ||
+        !(raw = (uint8_t *) malloc(largest)))
+      {
+        free(rom);
+        free(files);
+        return NULL;
+      }
+    memcpy(rom, "\x80\x37\x12\x40", 4);
+    memcpy(&rom[0x20], spec->mm ? "ZELDA MAJORA'S MASK " : "THE LEGEND OF ZELDA ", 20);
+    for (names = &rom[0x2060], f = 0; f < count; f++)
+      names += (SyntheticName(&files[f], f, (char *) names) + 4) & ~3;
+    /* makerom, boot and dmadata are stored as is, everything else compressed */
+    dma = files[2].vrom;
+    memcpy(&rom[dma + 4], "\0\0\x10\x60", 4);
+    memcpy(&rom[dma + 16], "\0\0\x10\x60", 4);
+    WRITE32(&rom[dma + 20], dma);
+    memcpy(&rom[dma + 24], "\0\0\x10\x60", 4);
+    WRITE32(&rom[dma + 32], dma);
+    WRITE32(&rom[dma + 36], dma + files[2].size);
+    WRITE32(&rom[dma + 40], dma);
+    for (phys = dma + files[2].size, f = 3; f < count; f++)
+      {
+        SyntheticContent(spec, files, count, f, raw, &seed);
+        size = yaz0enc(raw, files[f].size, &rom[phys]);
+        WRITE32(&rom[dma + f * 16], files[f].vrom);
+        WRITE32(&rom[dma + f * 16 + 4], files[f].vrom + files[f].size);
+        WRITE32(&rom[dma + f * 16 + 8], phys);
+        WRITE32(&rom[dma + f * 16 + 12], phys + size);
+        phys += size;
+      }
+    *romSize = (phys + 0xFFFFF) & ~0xFFFFF;
+    *fileCount = count;
+    if (spec->order == 1)
+      ScalarSwap32(rom, *romSize);
+    else if (spec->order == 2)
+      ScalarSwap16(rom, *romSize);
+    free(raw);
+    free(files);
+    return rom;
+  }
+
+
+static int WriteSyntheticRom(const char *filename, const SyntheticSpec *spec, uint32_t *fileCount,
+                             uint32_t *romSize)
+  {
+    uint8_t *rom = BuildSyntheticRom(spec, romSize, fileCount);
+    FILE *fp;
+    int ok;
+    if (!rom)
+      return 0;
+    if (!(fp = fopen(filename, "wb")))
+      {
+        free(rom);
+        return 0;
+      }
+    ok = fwrite(rom, 1, *romSize, fp) == *romSize;
+    ok = !fclose(fp) && ok;
+    free(rom);
+    return ok;
+  }
+
+
+static int MakeRom(const char *filename, const char *text)
+  {
+    SyntheticSpec spec;
+    uint32_t files, size;
+    if (!ParseSynthetic(&spec, text))
+      {
+        printf("ERROR:  Invalid rom description '%s'\n", text);
+        return 0;
+      }
+    if (!WriteSyntheticRom(filename, &spec, &files, &size))
+      {
+        printf("ERROR:  Failed to write '%s'\n", filename);
+        return 0;
+      }
+    printf("wrote '%s' [%s, %u files, %.1f MB]\n", filename, spec.mm ? "Majora's Mask" :
+           "Ocarina of Time", files, size / 1048576.0);
+    return 1;
+  }
+
+
+/* Extracts synthetic roms of 1, 2, 4 and 8 times the default table sizes
+ * for both games and prints the time of every stage.  The last column is
+ * how much the time per file grew from the smallest to the largest rom, so
+ * a stage that is worse than linear in the file count stands out.  The roms
+ * and what was extracted from them are left in the output directory.
+ * Returns 0 if a rom didn't come back with the tables and files it was made
+ * with, or if a stage that took long enough to measure grew by more than
+ * BENCHMARK_GROWTH per file.
+ */
+static int BenchmarkRoms(const Z64Options *base, uint64_t cacheSize)
+  {
+    static const uint32_t scales[] = {1, 2, 4, 8};
+    const char *output = base->output ? base->output : "z64bench";
+    double ms[4][Z64_STAGES + 1];
+    uint32_t files[4], size[4], found[3], game, s, stage;
+    double growth;
+    SyntheticSpec spec;
+    Z64Options options = *base;
+    Z64Stats stats;
+    Z64Rom *rom;
+    char filename[600], root[560];
+    int status, failed = 0;
+    if (strlen(output) > 500 || !MakeDirectories(output))
+      {
+        printf("ERROR:  Failed to create '%s'\n", output);
+        return 0;
+      }
+    options.archive = NULL;
+    options.incremental = 0;
+    for (game = 0; game < 2; game++)
+      {
+        for (s = 0; s < 4; s++)
+          {
+            SyntheticDefaults(&spec, game);
+            spec.scenes *= scales[s];
+            spec.actors *= scales[s];
+            spec.objects *= scales[s];
+            spec.misc *= scales[s];
+            sprintf(root, "%s/synthetic-%s-x%u", output, game ? "mm" : "oot", scales[s]);
+            sprintf(filename, "%s.z64", root);
+            if (!WriteSyntheticRom(filename, &spec, &files[s], &size[s]))
+              {
+                printf("ERROR:  Failed to write '%s'\n", filename);
+                return 0;
+              }
+            options.output = root;
+            if ((status = Z64Open(&rom, filename, NULL)) == Z64_OK)
+              {
+                Z64SetCacheSize(rom, cacheSize);
+                if ((status = Z64Locate(rom)) == Z64_OK)
+                  status = Z64Extract(rom, &options);
+                if (status == Z64_OK)
+                  {
+                    found[0] = Z64GetTableLength(rom, Z64_SCENES);
+                    found[1] = Z64GetTableLength(rom, Z64_ACTORS);
+                    found[2] = Z64GetTableLength(rom, Z64_OBJECTS);
+                  }
+                Z64GetStats(rom, &stats);
+                Z64Close(rom);
+              }
+            if (status != Z64_OK)
+              {
+                printf("ERROR:  '%s': %s\n", filename, Z64ErrorString(status));
+                return 0;
+              }
+            if (found[0] != spec.scenes || found[1] != spec.actors || found[2] != spec.objects)
+              {
+                printf("ERROR:  '%s': found %u scenes, %u actors and %u objects, made %u, %u and %u\n",
+                       filename, found[0], found[1], found[2], spec.scenes, spec.actors, spec.objects);
+                failed = 1;
+              }
+            if (!Filtered(&options) && !options.dedup && stats.written != files[s] - 4 - spec.misc)
+              {
+                printf("ERROR:  '%s': extracted %llu files, expected %u\n", filename,
+                       (unsigned long long)stats.written, files[s] - 4 - spec.misc);
+                failed = 1;
+              }
+            for (ms[s][Z64_STAGES] = 0, stage = 0; stage < Z64_STAGES; stage++)
+              {
+                ms[s][stage] = stats.wall[stage] * 1000;
+                ms[s][Z64_STAGES] += ms[s][stage];
+              }
+          }
+        printf("%s (ms)\n  %-16s", game ? "Majora's Mask" : "Ocarina of Time", "");
+        for (s = 0; s < 4; s++)
+          {
+            sprintf(root, "%ux %u MB", scales[s], size[s] >> 20);
+            printf(" %12s", root);
+          }
+        printf("  per file 8x/1x\n  %-16s", "files");
+        for (s = 0; s < 4; s++)
+          printf(" %12u", files[s]);
+        printf("\n");
+        for (stage = 0; stage <= Z64_STAGES; stage++)
+          {
+            if (stage == Z64_STAGE_LIST)
+              continue;
+            printf("  %-16s", stage < Z64_STAGES ? Z64StageName(stage) : "total");
+            for (s = 0; s < 4; s++)
+              printf(" %12.2f", ms[s][stage]);
+            if (ms[0][stage] > 0)
+              {
+                growth = ms[3][stage] / files[3] / (ms[0][stage] / files[0]);
+                printf("  %14.2fx", growth);
+                if (growth > BENCHMARK_GROWTH && ms[3][stage] >= BENCHMARK_MIN_MS)
+                  {
+                    printf("  FAIL");
+                    failed = 1;
+                  }
+                printf("\n");
+              }
+            else
+              printf("  %15s\n", "-");
+          }
+        printf("  %-16s", "us per file");
+        for (s = 0; s < 4; s++)
+          printf(" %12.2f", ms[s][Z64_STAGES] * 1000 / files[s]);
+        printf("\n\n");
+      }
+    printf("roms and output left in '%s'\n", output);
+    if (failed)
+      printf("ERROR:  Benchmark failed\n");
+    return !failed;
+  }
+
+/* --serve opens and locates every rom once and resolves their tables, then
+ * answers requests on a unix domain socket until it gets SIGINT or SIGTERM.
+ * Every message either way is a big endian u32 length followed by that many
+ * bytes.  A request is an op, a rom (its position on the command line) and
+ * the arguments of the op:
+ *
+ *   SERVE_INFO   op rom                 rom count, then per rom the game
+ *                                       (1 = mm), file count, the lengths of
+ *                                       the three tables and the file name
+ *                                       with a NUL after it
+ *   SERVE_LIST   op rom table           entry count, then the file index of
+ *                                       every entry (-1 = empty)
+ *   SERVE_TABLE  op rom table u32 id    the file entry id points to
+ *   SERVE_FILE   op rom u32 index       file index
+ *   SERVE_NAME   op rom name            the file called name (not terminated)
+ *
+ * A reply is a status byte and, for files, the index, virtual start and end
+ * (u32 each) and then the decompressed data.  Files stay in the rom's cache
+ * (--cache), so fetching the same scene again is just a copy.  Clients are
+ * served one request at a time and are expected to send whole requests.
+ */
+#ifdef _WIN32
+static int Serve(Batch *batch, const char *path)
+  {
+    printf("ERROR:  --serve needs unix domain sockets\n");
+    return 0;
+  }
+#else
+static volatile sig_atomic_t serveStop = 0;
+
+
+static void ServeSignal(int sig)
+  {
+    serveStop = 1;
+  }
+
+
+static int ServeRead(int fd, uint8_t *data, uint32_t size)
+  {
+    ssize_t n;
+    while (size)
+      {
+        if ((n = read(fd, data, size)) <= 0)
+          {
+            if (n < 0 && errno == EINTR && !serveStop)
+              continue;
+            return 0;
+          }
+        data += n;
+        size -= n;
+      }
+    return 1;
+  }
+
+
+static int ServeWrite(int fd, const uint8_t *data, uint32_t size)
+  {
+    ssize_t n;
+    while (size)
+      {
+        if ((n = write(fd, data, size)) < 0)
+          {
+            if (errno == EINTR && !serveStop)
+              continue;
+            return 0;
+          }
+        data += n;
+        size -= n;
+      }
+    return 1;
+  }
+
+
+/* head is the small fixed part of a reply, data the rest */
+static int ServeReply(int fd, int status, const uint8_t *head, uint32_t headSize,
+                      const uint8_t *data, uint32_t size)
+  {
+    uint8_t frame[32];
+    WRITE32(frame, 1 + headSize + size);
+    frame[4] = status;
+    if (headSize)
+      memcpy(&frame[5], head, headSize);
+    return ServeWrite(fd, frame, 5 + headSize) && ServeWrite(fd, data, size);
+  }
+
+
+static int ServeFile(ServedRom *served, int fd, int32_t index)
+  {
+    uint8_t head[12];
+    Z64File file;
+    int ok;
+    if (index < 0 || (uint32_t) index >= Z64GetFileCount(served->rom))
+      return ServeReply(fd, SERVE_NOT_FOUND, NULL, 0, NULL, 0);
+    if (!Z64GetFile(served->rom, &file, index))
+      return ServeReply(fd, SERVE_FAILED, NULL, 0, NULL, 0);
+    WRITE32(head, index);
+    WRITE32(&head[4], file.virtual.start);
+    WRITE32(&head[8], file.virtual.end);
+    ok = ServeReply(fd, SERVE_OK, head, 12, file.data, file.size);
+    Z64PutFile(served->rom, &file);
+    return ok;
+  }
+
+
+static int ServeInfo(Batch *batch, ServedRom *served, int fd)
+  {
+    uint32_t i, t, size = 4;
+    uint8_t *reply, *p;
+    int ok;
+    for (i = 0; i < batch->count; i++)
+      size += 17 + strlen(batch->roms[i].filename) + 1;
+    if (!(reply = (uint8_t *) malloc(size)))
+      return ServeReply(fd, SERVE_FAILED, NULL, 0, NULL, 0);
+    WRITE32(reply, batch->count);
+    for (p = &reply[4], i = 0; i < batch->count; i++)
+      {
+        *p = served[i].rom && Z64IsMajorasMask(served[i].rom);
+        WRITE32(&p[1], served[i].rom ? Z64GetFileCount(served[i].rom) : 0);
+        for (t = 0; t < 3; t++)
+          WRITE32(&p[5 + t * 4], served[i].length[t]);
+        p += 17;
+        strcpy((char *) p, batch->roms[i].filename);
+        p += strlen((char *) p) + 1;
+      }
+    ok = ServeReply(fd, SERVE_OK, NULL, 0, reply, size);
+    free(reply);
+    return ok;
+  }
+
+
+static int ServeList(ServedRom *served, int fd, uint32_t table)
+  {
+    uint32_t i, size = 4 + served->length[table] * 4;
+    uint8_t *reply;
+    int ok;
+    if (!(reply = (uint8_t *) malloc(size)))
+      return ServeReply(fd, SERVE_FAILED, NULL, 0, NULL, 0);
+    WRITE32(reply, served->length[table]);
+    for (i = 0; i < served->length[table]; i++)
+      WRITE32(&reply[4 + i * 4], (uint32_t) served->entries[table][i]);
+    ok = ServeReply(fd, SERVE_OK, NULL, 0, reply, size);
+    free(reply);
+    return ok;
+  }
+
+
+/* File names are compared in place rather than indexed; even a few thousand
+ * of them take a fraction of what decompressing the file does.
+ */
+static int ServeName(ServedRom *served, int fd, const uint8_t *name, uint32_t length)
+  {
+    char buffer[Z64_MAX_NAME + 1];
+    uint32_t i, count = Z64GetFileCount(served->rom);
+    for (i = 0; i < count; i++)
+      if (Z64GetFileName(served->rom, buffer, i) == length && !memcmp(buffer, name, length))
+        return ServeFile(served, fd, i);
+    return ServeReply(fd, SERVE_NOT_FOUND, NULL, 0, NULL, 0);
+  }
+
+
+/* Returns 0 if the client should be dropped. */
+static int ServeRequest(Batch *batch, ServedRom *served, int fd)
+  {
+    uint8_t request[SERVE_MAX_REQUEST];
+    uint32_t size, table, id;
+    ServedRom *target;
+    if (!ServeRead(fd, request, 4))
+      return 0;
+    size = READ32(request);
+    if (size < 2 || size > SERVE_MAX_REQUEST)
+      {
+        ServeReply(fd, SERVE_BAD_REQUEST, NULL, 0, NULL, 0);
+        return 0;
+      }
+    if (!ServeRead(fd, request, size))
+      return 0;
+    if (request[0] == SERVE_INFO)
+      return ServeInfo(batch, served, fd);
+    if (request[1] >= batch->count || !served[request[1]].rom)
+      return ServeReply(fd, SERVE_NOT_FOUND, NULL, 0, NULL, 0);
+    target = &served[request[1]];
+    table = size > 2 ? request[2] : 3;
+    switch (request[0])
+      {
+        case SERVE_LIST:
+          if (size != 3 || table > 2)
+            break;
+          return ServeList(target, fd, table);
+        case SERVE_TABLE:
+          if (size != 7 || table > 2)
+            break;
+          id = READ32(&request[3]);
+          if (id >= target->length[table] || target->entries[table][id] < 0)
+            return ServeReply(fd, SERVE_NOT_FOUND, NULL, 0, NULL, 0);
+          return ServeFile(target, fd, target->entries[table][id]);
+        case SERVE_FILE:
+          if (size != 6)
+            break;
+          return ServeFile(target, fd, (int32_t) READ32(&request[2]));
+        case SERVE_NAME:
+          if (size - 2 > Z64_MAX_NAME)
+            break;
+          return ServeName(target, fd, &request[2], size - 2);
+      }
+    return ServeReply(fd, SERVE_BAD_REQUEST, NULL, 0, NULL, 0);
+  }
+
+
+/* Roms that fail to open or locate are reported and left out; requests for
+ * them get SERVE_NOT_FOUND.
+ */
+static uint32_t ServeOpen(Batch *batch, ServedRom *served)
+  {
+    char index[4096];
+    uint32_t i, t, id, opened = 0;
+    int status;
+    for (i = 0; i < batch->count; i++)
+      {
+        if ((status = Z64Open(&served[i].rom, batch->roms[i].filename, stdout)) != Z64_OK)
+          {
+            printf("ERROR:  '%s': %s\n", batch->roms[i].filename, Z64ErrorString(status));
+            served[i].rom = NULL;
+            continue;
+          }
+        Z64SetCacheSize(served[i].rom, batch->cacheSize);
+        if (!batch->noIndex && strlen(batch->roms[i].filename) < sizeof(index) - 6)
+          {
+            sprintf(index, "%s.index", batch->roms[i].filename);
+            Z64SetIndexFile(served[i].rom, index);
+          }
+        if ((status = Z64Locate(served[i].rom)) != Z64_OK)
+          {
+            printf("ERROR:  '%s': %s\n", batch->roms[i].filename, Z64ErrorString(status));
+            Z64Close(served[i].rom);
+            served[i].rom = NULL;
+            continue;
+          }
+        for (t = 0; t < 3; t++)
+          {
+            served[i].length[t] = Z64GetTableLength(served[i].rom, t);
+            if (!(served[i].entries[t] = (int32_t *) malloc((served[i].length[t] + 1) * 4)))
+              {
+                served[i].length[t] = 0;
+                continue;
+              }
+            for (id = 0; id < served[i].length[t]; id++)
+              served[i].entries[t][id] = Z64GetTableFile(served[i].rom, t, id);
+          }
+        opened++;
+      }
+    return opened;
+  }
+
+
+static int Serve(Batch *batch, const char *path)
+  {
+    struct pollfd fds[2 + SERVE_MAX_CLIENTS];
+    struct sockaddr_un address = {0};
+    struct sigaction action = {0};
+    struct stat st;
+    ServedRom *served;
+    uint32_t i, t, opened, clients = 0;
+    int fd, ok = 0;
+    if (strlen(path) >= sizeof(address.sun_path))
+      {
+        printf("ERROR:  Socket path too long\n");
+        return 0;
+      }
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, path);
+    if (!stat(path, &st))
+      {
+        if (!S_ISSOCK(st.st_mode))
+          {
+            printf("ERROR:  '%s' exists and isn't a socket\n", path);
+            return 0;
+          }
+        /* a socket left behind by a server that didn't get to clean up
+         * refuses connections; anything else may still be in use
+         */
+        if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+          {
+            printf("ERROR:  Failed to create a socket\n");
+            return 0;
+          }
+        ok = !connect(fd, (struct sockaddr *) &address, sizeof(address)) || errno != ECONNREFUSED;
+        close(fd);
+        if (ok)
+          {
+            printf("ERROR:  '%s' is in use by another server\n", path);
+            return 0;
+          }
+        unlink(path);
+      }
+    if (!(served = (ServedRom *) calloc(batch->count, sizeof(ServedRom))))
+      {
+        printf("ERROR:  Failed to allocate memory\n");
+        return 0;
+      }
+    if (!(opened = ServeOpen(batch, served)))
+      {
+        printf("ERROR:  No rom to serve\n");
+        free(served);
+        return 0;
+      }
+    if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 ||
+        bind(fd, (struct sockaddr *) &address, sizeof(address)) || listen(fd, SERVE_MAX_CLIENTS))
+      printf("ERROR:  Failed to listen on '%s'\n", path);
+    else
+      {
+        ok = 1;
+        action.sa_handler = ServeSignal;
+        sigaction(SIGINT, &action, NULL);
+        sigaction(SIGTERM, &action, NULL);
+        signal(SIGPIPE, SIG_IGN);
+        printf("serving %u of %u roms on '%s'\n", opened, batch->count, path);
+        fflush(stdout);
+        fds[0].fd = fd;
+        fds[0].events = POLLIN;
+        while (!serveStop)
+          {
+            if (poll(fds, 1 + clients, -1) < 0)
+              {
+                if (errno == EINTR)
+                  continue;
+                break;
+              }
+            /* newest first, so a dropped client can be swapped with the last */
+            for (i = clients; i > 0; i--)
+              {
+                if (!(fds[i].revents & (POLLIN | POLLHUP | POLLERR)) ||
+                    ServeRequest(batch, served, fds[i].fd))
+                  continue;
+                close(fds[i].fd);
+                fds[i] = fds[clients--];
+              }
+            if (fds[0].revents & POLLIN && (fds[1 + clients].fd = accept(fd, NULL, NULL)) >= 0)
+              {
+                if (clients < SERVE_MAX_CLIENTS)
+                  fds[1 + clients++].events = POLLIN;
+                else
+                  close(fds[1 + clients].fd);
+              }
+          }
+        for (i = 1; i <= clients; i++)
+          close(fds[i].fd);
+        unlink(path);
+        printf("stopped serving '%s'\n", path);
+      }
+    if (fd >= 0)
+      close(fd);
+    for (i = 0; i < batch->count; i++)
+      {
+        if (served[i].rom)
+          Z64Close(served[i].rom);
+        for (t = 0; t < 3; t++)
+          free(served[i].entries[t]);
+      }
+    free(served);
+    return ok;
   }
+#endif
+#endif
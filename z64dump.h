@@ -0,0 +1,182 @@
+/* z64dump.h		Zelda64 Dump library interface
+ *
+ * z64dump.c builds either the command line tool or, with Z64DUMP_LIBRARY
+ * defined, just the library below.  Every rom is opened into its own
+ * Z64Rom, so several roms can be worked on at once from different threads;
+ * only the worker threads and the decompression buffers set up by Z64Init()
+ * are shared between them.
+ *************************************************************************/
+#ifndef Z64DUMP_H
+#define Z64DUMP_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+
+#define Z64_MAX_NAME		255
+
+typedef struct Z64Rom Z64Rom;
+
+/* A file from the file table.  data stays valid until Z64PutFile(). */
+typedef struct
+  {
+    struct
+      {
+        uint32_t start, end;
+      } physical, virtual;
+    uint8_t *data;
+    uint32_t size;
+    int32_t index;
+    uint8_t owner;
+  } Z64File;
+
+typedef struct
+  {
+    const char *output;		/* directory data/ goes in, NULL = current */
+    const char *archive;	/* write one pack file instead of data/ */
+    int dedup;			/* store identical files once */
+    int incremental;		/* skip files data/.manifest says are current */
+    uint32_t extract;		/* Z64_EXTRACT_* bits, 0 = everything */
+    uint32_t firstId, idCount;	/* table ids to extract, idCount 0 = all */
+    uint32_t categories;	/* bit n lets actors of group n through, 0 = all */
+    const char *name;		/* glob file names have to match (* and ?) */
+  } Z64Options;
+
+enum
+  {
+    Z64_OK			= 0,
+    Z64_ERROR_OPEN		= -1,
+    Z64_ERROR_MEMORY		= -2,
+    Z64_ERROR_ENDIANNESS	= -3,
+    Z64_ERROR_FILE_TABLE	= -4,
+    Z64_ERROR_CODE_FILE		= -5,
+    Z64_ERROR_SCENE_TABLE	= -6,
+    Z64_ERROR_OBJECT_TABLE	= -7,
+    Z64_ERROR_ACTOR_TABLE	= -8,
+    Z64_ERROR_THREADS		= -9,
+    Z64_ERROR_OUTPUT		= -10,
+    Z64_ERROR_NOT_LOCATED	= -11,
+    Z64_ERROR_DECODE		= -12
+  };
+
+enum
+  {
+    Z64_SCENES			= 0,
+    Z64_OBJECTS			= 1,
+    Z64_ACTORS			= 2
+  };
+
+/* what Z64Extract() writes; maps are found through their scenes, so scenes
+ * are still decompressed when only maps are asked for
+ */
+enum
+  {
+    Z64_EXTRACT_SCENES		= 1,
+    Z64_EXTRACT_MAPS		= 2,
+    Z64_EXTRACT_ACTORS		= 4,
+    Z64_EXTRACT_OBJECTS		= 8
+  };
+
+/* formats for Z64List() */
+enum
+  {
+    Z64_LIST_TEXT		= 0,
+    Z64_LIST_JSON		= 1,
+    Z64_LIST_CSV		= 2
+  };
+
+/* stages timed in Z64Stats */
+enum
+  {
+    Z64_STAGE_BYTESWAP		= 0,
+    Z64_STAGE_FILE_TABLE	= 1,
+    Z64_STAGE_CODE_FILE		= 2,
+    Z64_STAGE_NAME_TABLE	= 3,
+    Z64_STAGE_CODE_TABLES	= 4,
+    Z64_STAGE_SCENES		= 5,
+    Z64_STAGE_ACTORS		= 6,
+    Z64_STAGE_OBJECTS		= 7,
+    Z64_STAGE_FINISH		= 8,
+    Z64_STAGE_LIST		= 9,
+    Z64_STAGES			= 10
+  };
+
+/* What a rom has cost so far.  cpu is process time, so it includes any
+ * other rom being worked on at the same time; decode and write times are
+ * summed over the threads doing them.  The peak buffer size is shared by
+ * every rom and rss is the peak of the whole process.
+ */
+typedef struct
+  {
+    double wall[Z64_STAGES], cpu[Z64_STAGES];
+    double decodeTime, writeTime;
+    uint64_t scanned;			/* bytes searched in the rom and code */
+    uint64_t decoded, decodedIn, decodedOut;	/* Yaz0 files, bytes in, bytes out */
+    uint64_t written, writtenBytes;	/* files and bytes that reached the output */
+    uint64_t cacheHits, cacheMisses;
+    uint64_t peakCache, peakBuffers, peakRss;
+  } Z64Stats;
+
+/* file types from Z64GetFileType() */
+enum
+  {
+    ZDATA		= 0,
+    ZASM		= 1,
+    ZACTOR		= 2,
+    ZOBJ		= 4,
+    ZSCENE		= 5,
+    ZMAP		= 6,
+    ZTXT		= 7
+  };
+
+
+/* Starts jobs - 1 worker threads (0 = one per cpu) shared by every rom.
+ * Returns 0 if the threads couldn't be started.
+ */
+int Z64Init(uint32_t jobs);
+void Z64Shutdown(void);
+
+/* Progress and errors are written to log, which may be NULL. */
+int Z64Open(Z64Rom **rom, const char *filename, FILE *log);
+void Z64SetCacheSize(Z64Rom *rom, uint64_t bytes);
+/* Z64Locate() reuses what it found last time from path, if it still matches
+ * the rom, and writes it there otherwise; NULL (the default) for neither.
+ */
+void Z64SetIndexFile(Z64Rom *rom, const char *path);
+int Z64Locate(Z64Rom *rom);
+int Z64Extract(Z64Rom *rom, const Z64Options *options);
+int Z64List(Z64Rom *rom, const Z64Options *options, FILE *out, int format);
+/* Writes the rom (big endian, like a .z64) to filename with the files found
+ * where Z64Extract() would put them, in options->output or options->archive,
+ * put back in wherever they differ.
+ */
+int Z64Rebuild(Z64Rom *rom, const Z64Options *options, const char *filename);
+void Z64Close(Z64Rom *rom);
+const char *Z64ErrorString(int error);
+void Z64GetStats(Z64Rom *rom, Z64Stats *stats);
+const char *Z64StageName(int stage);
+
+/* These need a rom that Z64Locate() succeeded on. */
+int Z64IsMajorasMask(const Z64Rom *rom);
+uint32_t Z64GetFileCount(const Z64Rom *rom);
+uint32_t Z64GetTableLength(Z64Rom *rom, int table);
+int32_t Z64GetTableFile(Z64Rom *rom, int table, uint32_t id);
+int Z64GetFile(Z64Rom *rom, Z64File *file, int32_t index);
+void Z64PutFile(Z64Rom *rom, Z64File *file);
+uint32_t Z64GetFileName(Z64Rom *rom, char buffer[Z64_MAX_NAME + 1], int32_t index);
+int Z64GetFileType(const uint8_t *data, uint32_t size);
+/* the type Z64Locate() found file index to be from its contents, without
+ * decoding it again; Z64Extract() goes by the tables instead
+ */
+int Z64GetFileTypeOf(Z64Rom *rom, int32_t index);
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif